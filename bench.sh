@@ -0,0 +1,104 @@
+#!/bin/bash
+#
+# bench.sh: macro-benchmarks over the umbin programs (run by make bench)
+#
+# Runs each benchmark RUNS times on ./um and checks its output against the
+# expected file, then runs it once on ./um-count to count the instructions
+# it executes. Reports the best and mean wall time and MIPS (million
+# instructions per second, from the best time), and writes the results to
+# OUT as JSON, one benchmark per line.
+#
+# If BASELINE exists (set it empty to skip), each benchmark's best time is
+# compared with it, and the script fails when one is more than TOLERANCE
+# percent slower.
+# make bench-baseline stores the current results as the new baseline.
+#
+# Authors: Andrea Cabochan, Chance Rebish
+
+RUNS=${RUNS:-3}
+TOLERANCE=${TOLERANCE:-10}
+OUT=${OUT:-bench.json}
+BASELINE=${BASELINE-bench_baseline.json}
+
+# name, program, expected output
+BENCHMARKS="midmark umbin/midmark.um umbin/midmark.out
+sandmark umbin/sandmark.umz umbin/sandmark.out"
+
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+# Prints the field of a one-line JSON record
+field()
+{
+        sed -n "s/.*\"$2\": \"\{0,1\}\([^,\"}]*\).*/\1/p" <<< "$1"
+}
+
+status=0
+records=()
+
+printf "%-10s %10s %10s %14s %10s %10s\n" \
+       benchmark best mean instructions MIPS baseline
+
+while read -r name program expected; do
+        times=()
+        for ((i = 0; i < RUNS; i++)); do
+                start=$(date +%s%N)
+                ./um "$program" < /dev/null > "$tmp/out"
+                end=$(date +%s%N)
+                if ! cmp -s "$tmp/out" "$expected"; then
+                        echo "$name: output differs from $expected" >&2
+                        exit 1
+                fi
+                times+=($((end - start)))
+        done
+
+        ./um-count --stats "$program" < /dev/null > /dev/null 2> "$tmp/stats"
+        instructions=$(sed -n 's/^instructions executed: //p' "$tmp/stats")
+
+        read -r best mean mips <<< "$(printf "%s\n" "${times[@]}" | awk -v n="$instructions" '
+                NR == 1 || $1 < min { min = $1 }
+                { sum += $1 }
+                END { printf "%.3f %.3f %.1f\n", min / 1e9, sum / NR / 1e9,
+                             n / (min / 1e9) / 1e6 }')"
+
+        record="{\"name\": \"$name\", \"runs\": $RUNS, \"best\": $best, \"mean\": $mean, \"instructions\": $instructions, \"mips\": $mips}"
+        records+=("$record")
+
+        change="-"
+        if [ -f "$BASELINE" ]; then
+                old=$(grep "\"name\": \"$name\"" "$BASELINE")
+                old_best=$(field "$old" best)
+                old_instructions=$(field "$old" instructions)
+                if [ -n "$old_best" ]; then
+                        change=$(awk -v new="$best" -v old="$old_best" \
+                                 'BEGIN { printf "%+.1f%%", (new - old) / old * 100 }')
+                        if awk -v new="$best" -v old="$old_best" -v t="$TOLERANCE" \
+                               'BEGIN { exit !(new > old * (1 + t / 100)) }'; then
+                                echo "$name: best time $best s is more than" \
+                                     "$TOLERANCE% slower than the baseline" \
+                                     "$old_best s" >&2
+                                status=1
+                        fi
+                fi
+                if [ -n "$old_instructions" ] &&
+                   [ "$old_instructions" != "$instructions" ]; then
+                        echo "$name: executed $instructions instructions," \
+                             "baseline has $old_instructions" >&2
+                fi
+        fi
+
+        printf "%-10s %9ss %9ss %14s %10s %10s\n" \
+               "$name" "$best" "$mean" "$instructions" "$mips" "$change"
+done <<< "$BENCHMARKS"
+
+{
+        echo "{\"benchmarks\": ["
+        for ((i = 0; i < ${#records[@]}; i++)); do
+                sep=","
+                [ $((i + 1)) -eq ${#records[@]} ] && sep=""
+                echo "  ${records[$i]}$sep"
+        done
+        echo "]}"
+} > "$OUT"
+
+exit $status
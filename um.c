@@ -11,206 +11,202 @@
 * 
 * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 #include <stdio.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include "bitpack.h"
 #include "assert.h"
 #include "seq.h"
 #include "um_data.h"
+#include "um_run.h"
+#include "um_jit.h"
+#include "um_profile.h"
+#include "um_safe.h"
+#include "um_batch.h"
 // #include "um_ops.h"
 
-void run_um(Data data);
-
-uint32_t registers[8];
-
 /* * * * * * * * * * * * * * * * main * * * * * * * * * * * * * * *
  *
  * Reads a binary file representing a UM program and initializes
  * the UM data structure, then runs the UM program.
  *
  * Parameters:
- *      int argc: number of command-line arguments (must be 2)
- *      char *argv[]: array of arguments, where argv[1] is the path to the UM 
- *      binary file
+ *      int argc: number of command-line arguments
+ *      char *argv[]: array of arguments, where the last is the path to the
+ *      UM binary file, optionally preceded by --jit, --stats,
+ *      --stats-file FILE, --profile FILE, --safe, --huge-pages WORDS,
+ *      --output FILE and --snapshot-at-input FILE. --restore FILE or
+ *      --batch LIST takes the place of the UM binary, and --isolate may
+ *      go with --batch.
  *
  * Return: 
  *      EXIT_SUCCESS upon successful execution
  *
  * Expects:
- *      argc must be 2
- *      argv[1] must be a valid file path to a binary UM program
+ *      argv must name exactly one UM program, snapshot or job list
  *      The file must exist and be readable
  * 
  * Notes:
+ *      With --jit the program runs on the x86-64 JIT, falling back to the
+ *      interpreter when the JIT is unavailable. With --stats, statistics
+ *      from the data layer are printed to stderr once the program halts,
+ *      along with the interpreter's instruction mix and map sizes in the
+ *      counting build (um-count); --stats-file prints them to FILE.
+ *      --profile samples the pc while the program runs on the interpreter
+ *      (even with --jit) and writes annotated disassembly to FILE.
+ *      --safe also runs on the interpreter, with guard pages after large
+ *      segments, and reports a load or store past the end of one with its
+ *      segment, word and pc (see um_safe.c); it overrides --profile.
+ *      --huge-pages puts segments of at least WORDS words on transparent
+ *      huge pages (524288 words fill one), and --stats then shows how
+ *      many bytes the kernel backed with them. Guard pages win over huge
+ *      pages for the segments both would take.
+ *      With --output, UM output is written to FILE in batch mode.
+ *      --snapshot-at-input saves the machine to FILE the first time the
+ *      program blocks on input, and --restore resumes from such a file.
+ *      --batch runs every job in LIST in parallel (see um_batch.c) and
+ *      exits with failure if any job's output was not as expected. Jobs
+ *      run on threads of this process; --isolate runs each in a um
+ *      process of its own instead, so a job that faults does not end
+ *      the batch.
  *      Frees all allocated memory before returning.
  *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
  int main(int argc, char *argv[])
 {
-        if (argc != 2) {
+        bool use_jit = false;
+        bool stats = false;
+        bool safe = false;
+        bool isolate = false;
+        uint32_t huge_min = 0;
+        char *stats_file = NULL;
+        char *profile = NULL;
+        char *output = NULL;
+        char *snapshot = NULL;
+        char *restore = NULL;
+        char *batch = NULL;
+        char *path = NULL;
+
+        for (int i = 1; i < argc; i++) {
+                if (strcmp(argv[i], "--jit") == 0) {
+                        use_jit = true;
+                } else if (strcmp(argv[i], "--stats") == 0) {
+                        stats = true;
+                } else if (strcmp(argv[i], "--stats-file") == 0 &&
+                           i + 1 < argc) {
+                        stats = true;
+                        stats_file = argv[++i];
+                } else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+                        profile = argv[++i];
+                } else if (strcmp(argv[i], "--safe") == 0) {
+                        safe = true;
+                } else if (strcmp(argv[i], "--huge-pages") == 0 &&
+                           i + 1 < argc) {
+                        huge_min = strtoul(argv[++i], NULL, 10);
+                        if (huge_min == 0) {
+                                fprintf(stderr, "Invalid --huge-pages size");
+                                return EXIT_FAILURE;
+                        }
+                } else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+                        output = argv[++i];
+                } else if (strcmp(argv[i], "--snapshot-at-input") == 0 &&
+                           i + 1 < argc) {
+                        snapshot = argv[++i];
+                } else if (strcmp(argv[i], "--restore") == 0 && i + 1 < argc) {
+                        restore = argv[++i];
+                } else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+                        batch = argv[++i];
+                } else if (strcmp(argv[i], "--isolate") == 0) {
+                        isolate = true;
+                } else if (path == NULL) {
+                        path = argv[i];
+                } else {
+                        path = NULL;
+                        break;
+                }
+        }
+
+        if ((path != NULL) + (restore != NULL) + (batch != NULL) != 1) {
                 fprintf(stderr, "Invalid argument amount");
                 return EXIT_FAILURE;
         }
 
-        FILE *fp = fopen(argv[1], "rb");
-        assert(fp != NULL);
+        if (batch != NULL) {
+                return run_batch(batch, use_jit, isolate);
+        }
 
-        Data data = initialize_data(fp);
-        fclose(fp);
+        Data data;
+        if (restore != NULL) {
+                data = restore_data(restore);
+        } else {
+                FILE *fp = fopen(path, "rb");
+                assert(fp != NULL);
+
+                data = initialize_data(fp);
+                fclose(fp);
+                if (data == NULL) {
+                        fprintf(stderr, "Invalid .um file");
+                        return EXIT_FAILURE;
+                }
+        }
 
-        for (int i = 0; i < 8; i++) {
-                registers[i] = 0;
+        /* Safe mode guards segment 0 instead of write-protecting it */
+        if (!safe) {
+                use_write_barrier(data);
         }
 
-        run_um(data);
+        if (snapshot != NULL) {
+                snapshot_at_input(data, snapshot);
+        }
 
-        data_free(&data);
+        if (huge_min != 0) {
+                set_huge_pages(data, huge_min);
+        }
 
-        return EXIT_SUCCESS;
-}
+        int output_fd = -1;
+        if (output != NULL) {
+                output_fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+                assert(output_fd >= 0);
+                set_output_fd(data, output_fd);
+        }
 
-/* * * * * * * * * * * * * * * * run_um * * * * * * * * * * * * * * *
- *
- * Executes the loaded UM program by repeatedly decoding and executing
- * instructions from memory until the halt instruction (opcode 7) is reached.
- *
- * Parameters:
- *      Data data: the UM data structure containing registers, memory,
- *                 and the program counter
- *
- * Return:
- *      void
- *
- * Expects:
- *      data is a valid, initialized UM Data structure
- *
- * Notes:
- *      The function does not return until the halt instruction is executed.
- *      Each instruction is decoded and dispatched to the appropriate handler.
- *      Modifies the internal state of `data` as it executes instructions.
- *
- * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
-void run_um(Data data) 
-{
-        /* Grab the word and opcode from the word */
-        uint32_t word = extract_word(data);
-        // uint32_t opcode = Bitpack_getu(word, 4, 28); 
-        // uint32_t opcode = (0xF0000000 & word) >> 28;
-        
-        int input;
-
-        /* While the halt instruction has not been called */
-        while ((word >> 28) != 7) {
-
-                // /* Grab the register to be used */
-                // uint32_t ra = Bitpack_getu(word, 3, 6);
-                // uint32_t rb = Bitpack_getu(word, 3, 3);
-                // uint32_t rc = Bitpack_getu(word, 3, 0);
-
-                /* Switch case for each instruction */
-                switch(word >> 28) {
-                        case 0:
-                                // conditional_move(data, (word & 0x1C0) >> 6, (word & 0x38) >> 3, (word & 0x7));
-                                if (registers[(word & 0x7)] != 0) {
-                                        registers[(word & 0x1C0) >> 6] = registers[(word & 0x38) >> 3]; 
-                                }
-                                break;
-                        case 1:
-                                // segment_load(data, (word & 0x1C0) >> 6, (word & 0x38) >> 3, (word & 0x7));
-                                registers[(word & 0x1C0) >> 6] = get_word(data, registers[(word & 0x38) >> 3], registers[(word & 0x7)]); 
-
-                                // set_register(data, (word & 0x1C0) >> 6, );
-                                break;
-                        case 2: 
-                                // segment_store(data, (word & 0x1C0) >> 6, (word & 0x38) >> 3, (word & 0x7));
-
-                                set_word(data, registers[(word & 0x1C0) >> 6], registers[(word & 0x38) >> 3], registers[(word & 0x7)]);
-                        
-                                break;
-                        case 3:
-                                // add(data, (word & 0x1C0) >> 6, (word & 0x38) >> 3, (word & 0x7));
-
-                                registers[(word & 0x1C0) >> 6] = registers[(word & 0x38) >> 3] + registers[(word & 0x7)]; 
-
-                                // set_register(data, (word & 0x1C0) >> 6, get_register(data, (word & 0x38) >> 3) + get_register(data, (word & 0x7)));
-                        
-                                break;
-                        case 4:
-                                // multiplication(data, (word & 0x1C0) >> 6, (word & 0x38) >> 3, (word & 0x7));
-
-                                registers[(word & 0x1C0) >> 6] = registers[(word & 0x38) >> 3] * registers[(word & 0x7)]; 
-
-                                // set_register(data, (word & 0x1C0) >> 6, get_register(data, (word & 0x38) >> 3) * get_register(data, (word & 0x7)));
-                        
-                                break;
-                        case 5:
-                                // division(data, (word & 0x1C0) >> 6, (word & 0x38) >> 3, (word & 0x7));
-
-                                registers[(word & 0x1C0) >> 6] = registers[(word & 0x38) >> 3] / registers[(word & 0x7)]; 
-
-                                // set_register(data, (word & 0x1C0) >> 6, get_register(data, (word & 0x38) >> 3) / get_register(data, (word & 0x7)));
-                        
-                                break;
-                        case 6:
-                                // bitwiseNAND(data, (word & 0x1C0) >> 6, (word & 0x38) >> 3, (word & 0x7));
-                                // uint32_t NAND = ~(get_register(data, B) & get_register(data, C));
-                                registers[(word & 0x1C0) >> 6] = ~(registers[(word & 0x38) >> 3] & registers[(word & 0x7)]);                        
-                                break;
-                        case 7:
-                                break;
-                        case 8:
-                                // map_segment(data, (word & 0x38) >> 3, (word & 0x7));
-
-                                registers[(word & 0x38) >> 3] = insert_segment(data, registers[(word & 0x7)]);
-                                
-                                break;
-                        case 9:
-                                // unmap_segment(data, (word & 0x7));
-
-                                set_segment_false(data, registers[(word & 0x7)]);
-
-                                break;
-                        case 10:
-                                // output(data, (word & 0x7));
-
-                                putchar((char) registers[(word & 0x7)]);
-
-                                break;
-                        case 11:
-                                //input(data, (word & 0x7));
-
-                                input = getchar();
-
-                                if (input == EOF) {
-                                        registers[(word & 0x7)] = 0xFFFFFFFF;
-                                } else {
-                                        if (input >= 0 && input <= 255) {
-                                                registers[(word & 0x7)] = input;         
-                                        }
-                                }
-                        
-                                break;
-                        case 12:
-                                // load_program(data, (word & 0x38) >> 3, (word & 0x7));
-
-                                replace_segment_0(data, registers[(word & 0x38) >> 3], registers[(word & 0x7)]);
-
-                                break;
-                        case 13: 
-                                // load_val(data, word);
-                                
-                                // set_register(data, (word & 0xE000000) >> 25, (word & 0x1FFFFFF));
-
-                                registers[(word & 0xE000000) >> 25] = (word & 0x1FFFFFF);
-
-                                break;
+        if (safe) {
+                safe_start(data);
+                run_um_safe(data);
+                safe_stop();
+        } else if (profile != NULL) {
+                profile_start(profile);
+                run_um_profiled(data);
+                profile_stop(data);
+        } else if (!use_jit || !jit_run(data, data_registers(data))) {
+                run_um(data);
+        }
+
+        if (stats) {
+                FILE *out = stderr;
+                if (stats_file != NULL) {
+                        out = fopen(stats_file, "w");
+                        assert(out != NULL);
+                }
+
+                flush_output(data);
+                data_stats(data, out);
+#ifdef UM_COUNT
+                run_stats(out);
+#endif
+                if (out != stderr) {
+                        fclose(out);
                 }
-                
-                /* Grab the next word and repeat */
-                word = extract_word(data);
-                // opcode = Bitpack_getu(word, 4, 28);
-                // opcode = (0xF0000000 & word) >> 28;
         }
-}
 
+        data_free(&data);
+
+        if (output_fd >= 0) {
+                close(output_fd);
+        }
+
+        return EXIT_SUCCESS;
+}
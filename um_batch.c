@@ -0,0 +1,495 @@
+/* * * * * * * * * * * * * * * * * um_batch.c * * * * * * * * * * * * * * * * *
+*
+*     Assignment: CS40 Universal Machine
+*     Authors:  Andrea Cabochan, Chance Rebish
+*     Date:     April 04, 2025
+*
+*     Summary:
+*     Runs many UM programs in one process for um --batch. Each line of the
+*     job list names a program, optionally followed by a file to use as its
+*     input and a file holding its expected output ("-" for none):
+*
+*         add.um - add.1
+*         input-output.um input-output.0 input-output.1
+*
+*     Every job gets its own machine, so jobs run in parallel on a pool of
+*     one thread per core. Jobs are dealt out to per-thread queues, and a
+*     thread whose queue is empty steals from the others. Output goes to a
+*     temporary file and is compared with the expected file, and each job's
+*     wall time and result is reported in list order. A job whose program
+*     is not a whole number of words is reported as invalid and the others
+*     carry on. A UM fault in one job ends the whole batch, unless --isolate
+*     runs each job in a um process of its own, spawned by its worker; a
+*     job whose process does not exit cleanly is then reported as crashed.
+*
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <spawn.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "assert.h"
+#include "um_data.h"
+#include "um_run.h"
+#include "um_jit.h"
+#include "um_batch.h"
+
+#define MAX_LINE 4096
+
+extern char **environ;
+
+/* Outcome of one job */
+enum Result {
+        NOT_RUN, PASSED, FAILED, UNCHECKED, NO_PROGRAM, NO_INPUT, INVALID,
+        CRASHED
+};
+
+/* One line of the job list */
+struct Job {
+        char *program;
+        char *input;            /* NULL to read nothing */
+        char *expected;         /* NULL to skip the check */
+        double seconds;
+        enum Result result;
+        int status;             /* How a CRASHED job's process ended */
+};
+
+/* A thread's queue of job indices. The owner takes from the front and
+   thieves take from the back. */
+struct Queue {
+        pthread_mutex_t lock;
+        size_t *jobs;
+        size_t front, back;
+};
+
+struct Pool {
+        struct Job *jobs;
+        struct Queue *queues;
+        int threads;
+        bool use_jit;
+        const char *um;         /* um executable for --isolate, or NULL */
+};
+
+struct Worker {
+        struct Pool *pool;
+        int id;
+};
+
+/* * * * * * * * * * * * * * * * * read_jobs * * * * * * * * * * * * * * * * *
+*
+* Reads the job list. Blank lines and lines starting with # are skipped.
+*
+* Parameters:
+*      const char *list:        path of the job list
+*      size_t *count:           set to the number of jobs
+*
+* Return: newly allocated array of jobs, or NULL if list cannot be read
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static struct Job *read_jobs(const char *list, size_t *count)
+{
+        FILE *fp = fopen(list, "r");
+        if (fp == NULL) {
+                return NULL;
+        }
+
+        size_t capacity = 64;
+        struct Job *jobs = malloc(capacity * sizeof(struct Job));
+        assert(jobs != NULL);
+        char line[MAX_LINE];
+        *count = 0;
+
+        while (fgets(line, sizeof(line), fp) != NULL) {
+                char *save;
+                char *fields[3] = { NULL, NULL, NULL };
+                char *word = strtok_r(line, " \t\r\n", &save);
+
+                for (int i = 0; i < 3 && word != NULL; i++) {
+                        fields[i] = word;
+                        word = strtok_r(NULL, " \t\r\n", &save);
+                }
+                if (fields[0] == NULL || fields[0][0] == '#') {
+                        continue;
+                }
+
+                if (*count == capacity) {
+                        capacity *= 2;
+                        jobs = realloc(jobs, capacity * sizeof(struct Job));
+                        assert(jobs != NULL);
+                }
+
+                struct Job *job = &jobs[(*count)++];
+                job->program = strdup(fields[0]);
+                job->input = NULL;
+                job->expected = NULL;
+                if (fields[1] != NULL && strcmp(fields[1], "-") != 0) {
+                        job->input = strdup(fields[1]);
+                }
+                if (fields[2] != NULL && strcmp(fields[2], "-") != 0) {
+                        job->expected = strdup(fields[2]);
+                }
+                job->seconds = 0;
+                job->result = NOT_RUN;
+                job->status = 0;
+        }
+
+        fclose(fp);
+        return jobs;
+}
+
+/* * * * * * * * * * * * * * * * * same_contents * * * * * * * * * * * * * * *
+*
+* Compares the output a job wrote with its expected file.
+*
+* Parameters:
+*      FILE *output:            the job's output, any position
+*      const char *expected:    path of the expected output
+*
+* Return: true if both hold the same bytes
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static bool same_contents(FILE *output, const char *expected)
+{
+        FILE *fp = fopen(expected, "rb");
+        if (fp == NULL) {
+                return false;
+        }
+        rewind(output);
+
+        char a[4096], b[4096];
+        bool same = true;
+        for (;;) {
+                size_t n = fread(a, 1, sizeof(a), output);
+                size_t m = fread(b, 1, sizeof(b), fp);
+                if (n != m || memcmp(a, b, n) != 0) {
+                        same = false;
+                        break;
+                }
+                if (n == 0) {
+                        break;
+                }
+        }
+
+        fclose(fp);
+        return same;
+}
+
+/* * * * * * * * * * * * * * * * * run_machine * * * * * * * * * * * * * * * *
+*
+* Runs a job's program on a machine of its own, on the calling thread.
+*
+* Parameters:
+*      FILE *fp:                the program, open for reading
+*      int input:               the job's input
+*      int output:              where the job's output goes
+*      bool use_jit:            run on the JIT where it is available
+*
+* Return: true once the program halts, false if it could not be loaded
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static bool run_machine(FILE *fp, int input, int output, bool use_jit)
+{
+        Data data = initialize_data(fp);
+        if (data == NULL) {
+                return false;
+        }
+        use_write_barrier(data);
+        set_input_fd(data, input);
+        set_output_fd(data, output);
+
+        if (!use_jit || !jit_run(data, data_registers(data))) {
+                run_um(data);
+        }
+        data_free(&data);
+        return true;
+}
+
+/* * * * * * * * * * * * * * * * * run_isolated * * * * * * * * * * * * * * * *
+*
+* Runs a job's program in a um process of its own and waits for it.
+*
+* Parameters:
+*      const char *um:          path of the um executable
+*      struct Job *job:         the job to run
+*      int input:               becomes the process's standard input
+*      int output:              becomes the process's standard output
+*      bool use_jit:            pass --jit
+*
+* Return: the process's wait status, or -1 if it could not be started
+*
+* Notes:
+*      posix_spawn starts the process without running any code of this
+*      one in it, so it is safe while the other workers hold locks
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static int run_isolated(const char *um, struct Job *job, int input,
+                        int output, bool use_jit)
+{
+        char *argv[4];
+        int argc = 0;
+        argv[argc++] = (char *) um;
+        if (use_jit) {
+                argv[argc++] = "--jit";
+        }
+        argv[argc++] = job->program;
+        argv[argc] = NULL;
+
+        posix_spawn_file_actions_t actions;
+        posix_spawn_file_actions_init(&actions);
+        posix_spawn_file_actions_adddup2(&actions, input, STDIN_FILENO);
+        posix_spawn_file_actions_adddup2(&actions, output, STDOUT_FILENO);
+
+        pid_t child;
+        int err = posix_spawn(&child, um, &actions, NULL, argv, environ);
+        posix_spawn_file_actions_destroy(&actions);
+        if (err != 0) {
+                return -1;
+        }
+
+        int status;
+        while (waitpid(child, &status, 0) < 0) {
+                assert(errno == EINTR);
+        }
+        return status;
+}
+
+/* * * * * * * * * * * * * * * * * run_job * * * * * * * * * * * * * * * * * *
+*
+* Runs one job on a machine of its own and records its time and result.
+*
+* Parameters:
+*      struct Job *job:         the job to run
+*      bool use_jit:            run on the JIT where it is available
+*      const char *um:          um executable to run the job in, or NULL to
+*                               run it on the calling thread
+*
+* Return: nothing
+*
+* Notes:
+*      A job without an input file reads from /dev/null, never from the
+*      process's standard input. A program that cannot be loaded leaves the
+*      job INVALID. A um process that does not exit with status 0 leaves it
+*      CRASHED, with its wait status kept for the report.
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static void run_job(struct Job *job, bool use_jit, const char *um)
+{
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        FILE *fp = fopen(job->program, "rbe");
+        if (fp == NULL) {
+                job->result = NO_PROGRAM;
+                return;
+        }
+        int input = open(job->input != NULL ? job->input : "/dev/null",
+                         O_RDONLY | O_CLOEXEC);
+        if (input < 0) {
+                fclose(fp);
+                job->result = NO_INPUT;
+                return;
+        }
+        FILE *output = tmpfile();
+        assert(output != NULL);
+
+        bool loaded = true;
+        int status = 0;
+        if (um == NULL) {
+                loaded = run_machine(fp, input, fileno(output), use_jit);
+        } else {
+                status = run_isolated(um, job, input, fileno(output),
+                                      use_jit);
+        }
+        fclose(fp);
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        job->seconds = (end.tv_sec - start.tv_sec) +
+                       (end.tv_nsec - start.tv_nsec) / 1e9;
+
+        if (!loaded) {
+                job->result = INVALID;
+        } else if (status != 0) {
+                job->result = CRASHED;
+                job->status = status;
+        } else if (job->expected == NULL) {
+                job->result = UNCHECKED;
+        } else {
+                job->result = same_contents(output, job->expected) ?
+                              PASSED : FAILED;
+        }
+
+        fclose(output);
+        close(input);
+}
+
+/* * * * * * * * * * * * * * * * * next_job * * * * * * * * * * * * * * * * *
+*
+* Finds a worker's next job: the front of its own queue, or else the back
+* of the first other queue that has one.
+*
+* Parameters:
+*      struct Pool *pool:       the thread pool
+*      int id:                  the worker asking
+*      size_t *job:             set to the index of the job found
+*
+* Return: false once every queue is empty
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static bool next_job(struct Pool *pool, int id, size_t *job)
+{
+        for (int i = 0; i < pool->threads; i++) {
+                struct Queue *q = &pool->queues[(id + i) % pool->threads];
+                bool found = false;
+
+                pthread_mutex_lock(&q->lock);
+                if (q->front < q->back) {
+                        *job = (i == 0) ? q->jobs[q->front++] :
+                                          q->jobs[--q->back];
+                        found = true;
+                }
+                pthread_mutex_unlock(&q->lock);
+
+                if (found) {
+                        return true;
+                }
+        }
+        return false;
+}
+
+static void *worker(void *arg)
+{
+        struct Worker *w = arg;
+        size_t job;
+
+        while (next_job(w->pool, w->id, &job)) {
+                run_job(&w->pool->jobs[job], w->pool->use_jit,
+                        w->pool->um);
+        }
+        return NULL;
+}
+
+/* * * * * * * * * * * * * * * * * run_batch * * * * * * * * * * * * * * * * *
+*
+* Runs every job in a job list on a pool of threads, then prints each
+* job's result and time followed by a summary.
+*
+* Parameters:
+*      const char *list:        path of the job list (see the top of file)
+*      bool use_jit:            run jobs on the JIT where it is available
+*      bool isolate:            run each job in a um process of its own
+*
+* Return: EXIT_SUCCESS if no job failed its check, crashed or could not be
+*         run, EXIT_FAILURE otherwise
+*
+* Notes:
+*      The pool has one thread per online core, and never more threads
+*      than jobs. Relative paths are taken from the current directory.
+*      Isolated jobs run the executable this process was started from.
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+int run_batch(const char *list, bool use_jit, bool isolate)
+{
+        char um[PATH_MAX];
+        if (isolate) {
+                ssize_t n = readlink("/proc/self/exe", um, sizeof(um) - 1);
+                if (n < 0) {
+                        fprintf(stderr, "Could not find um for --isolate\n");
+                        return EXIT_FAILURE;
+                }
+                um[n] = '\0';
+        }
+
+        size_t count;
+        struct Job *jobs = read_jobs(list, &count);
+        if (jobs == NULL) {
+                fprintf(stderr, "Could not read job list %s\n", list);
+                return EXIT_FAILURE;
+        }
+
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        int threads = cores < 1 ? 1 : (int) cores;
+        if ((size_t) threads > count) {
+                threads = count == 0 ? 1 : (int) count;
+        }
+
+        /* Deal the jobs out round-robin */
+        struct Pool pool = { jobs, NULL, threads, use_jit,
+                             isolate ? um : NULL };
+        pool.queues = malloc(threads * sizeof(struct Queue));
+        assert(pool.queues != NULL);
+        for (int t = 0; t < threads; t++) {
+                struct Queue *q = &pool.queues[t];
+                pthread_mutex_init(&q->lock, NULL);
+                q->jobs = malloc((count / threads + 1) * sizeof(size_t));
+                assert(q->jobs != NULL);
+                q->front = q->back = 0;
+        }
+        for (size_t i = 0; i < count; i++) {
+                struct Queue *q = &pool.queues[i % threads];
+                q->jobs[q->back++] = i;
+        }
+
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        pthread_t *ids = malloc(threads * sizeof(pthread_t));
+        struct Worker *workers = malloc(threads * sizeof(struct Worker));
+        assert(ids != NULL && workers != NULL);
+        for (int t = 0; t < threads; t++) {
+                workers[t].pool = &pool;
+                workers[t].id = t;
+                int err = pthread_create(&ids[t], NULL, worker, &workers[t]);
+                assert(err == 0);
+        }
+        for (int t = 0; t < threads; t++) {
+                pthread_join(ids[t], NULL);
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        static const char *const words[] = {
+                "-", "ok", "FAIL", "ran", "NOFILE", "NOINPUT", "INVALID",
+                "CRASH"
+        };
+        size_t tally[8] = { 0 };
+        for (size_t i = 0; i < count; i++) {
+                struct Job *job = &jobs[i];
+                tally[job->result]++;
+                printf("%-7s %10.3f ms  %s", words[job->result],
+                       job->seconds * 1000, job->program);
+                if (job->result != CRASHED) {
+                        printf("\n");
+                } else if (job->status == -1) {
+                        printf(" (could not start um)\n");
+                } else if (WIFSIGNALED(job->status)) {
+                        printf(" (%s)\n", strsignal(WTERMSIG(job->status)));
+                } else {
+                        printf(" (exit status %d)\n",
+                               WEXITSTATUS(job->status));
+                }
+        }
+        printf("%zu jobs on %d threads in %.3f s: %zu passed, %zu failed, "
+               "%zu crashed, %zu not checked, %zu not run\n", count, threads,
+               (end.tv_sec - start.tv_sec) +
+               (end.tv_nsec - start.tv_nsec) / 1e9,
+               tally[PASSED], tally[FAILED] + tally[INVALID], tally[CRASHED],
+               tally[UNCHECKED], tally[NO_PROGRAM] + tally[NO_INPUT]);
+
+        for (int t = 0; t < threads; t++) {
+                pthread_mutex_destroy(&pool.queues[t].lock);
+                free(pool.queues[t].jobs);
+        }
+        for (size_t i = 0; i < count; i++) {
+                free(jobs[i].program);
+                free(jobs[i].input);
+                free(jobs[i].expected);
+        }
+        free(pool.queues);
+        free(ids);
+        free(workers);
+        free(jobs);
+
+        bool failed = tally[FAILED] + tally[INVALID] + tally[CRASHED] +
+                      tally[NO_PROGRAM] + tally[NO_INPUT] > 0;
+        return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,19 @@
+/* * * * * * * * * * * * * * * * * um_batch.h * * * * * * * * * * * * * * * * *
+*
+*     Assignment: CS40 Universal Machine
+*     Authors:  Andrea Cabochan, Chance Rebish
+*     Date:     April 04, 2025
+*
+*     Summary:
+*     Declares the batch runner defined in um_batch.c, used by um --batch
+*
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef UM_BATCH_INCLUDED
+#define UM_BATCH_INCLUDED
+
+#include <stdbool.h>
+
+extern int run_batch(const char *list, bool use_jit, bool isolate);
+
+#endif
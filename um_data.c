@@ -16,159 +16,2431 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "assert.h"
-#include "seq.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #define T Data
 
-/* struct Data
+/*
+ * Every segment is allocated with two header words in front of word 0: its
+ * length, and the number of segment table entries sharing it, so that
+ * both sit on the cache line of the words themselves. load_program shares
+ * its source with segment 0 instead of copying it, and set_word copies a
+ * shared segment before the first store to it.
+ */
+#define HEADER_WORDS 2
+#define LENGTH(seg) ((seg)[-2])
+#define REFS(seg) ((seg)[-1])
+
+/*
+ * A buffer of at least ALIGNED_MIN_PAGES pages (pooled or a lazily zeroed
+ * mapping) starts with a page of its own, whose last bytes hold the header
+ * words, so that word 0 is on a page boundary. Such a segment can be
+ * write-protected in place when load_program makes it segment 0, without
+ * the header ever being on a protected page (see protect_code).
+ */
+#define ALIGNED_MIN_PAGES 4
+
+/*
+ * An unmapped entry of the segment table holds the next identifier on the
+ * free list in place of a segment pointer, tagged in its low bit, which is
+ * never set in a pointer to word 0.
+ */
+#define FREE_ENTRY(next) ((uint32_t *) (((uintptr_t) (next) << 1) | 1))
+#define IS_FREE(seg) (((uintptr_t) (seg) & 1) != 0)
+#define NEXT_FREE(seg) ((uint32_t) ((uintptr_t) (seg) >> 1))
+
+/*
+ * Segment buffers (header words included) of up to 2^POOL_MAX_CLASS words
+ * are allocated in power-of-two size classes and recycled through per-class
+ * free lists instead of going back to malloc. At most POOL_LIMIT bytes are
+ * held on the free lists at once.
+ */
+#define POOL_MIN_CLASS 2
+#define POOL_MAX_CLASS 15
+#define POOL_LIMIT (64 << 20)
+
+/*
+ * Larger segments are anonymous mappings of 2^class words, which the kernel
+ * zero-fills a page at a time as they are first touched, so mapping one
+ * costs the same whatever its size. (Below 128 KB the madvise and page
+ * faults cost more than clearing a pooled buffer.) A released mapping is
+ * emptied with MADV_DONTNEED, which makes its pages zero again, and kept on
+ * a free list of its class for reuse. At most LAZY_LIMIT bytes of address
+ * space are kept on these lists.
+ */
+#define MAX_CLASS 34
+#define LAZY_LIMIT ((size_t) 1 << 32)
+
+/* How a segment of a given length is allocated (see segment_backing) */
+enum Backing { POOLED, LAZY, HUGE, GUARDED };
+
+/*
+ * Once guard_segments is called, segments of at least GUARD_MIN_WORDS words
+ * get a mapping of their own, laid out so that the last word ends where a
+ * PROT_NONE guard page begins. Smaller ones would waste most of a page and
+ * stay in the pool.
+ */
+#define GUARD_MIN_WORDS 1024
+
+/*
+ * Segments of at least huge_min words (see set_huge_pages) get a mapping of
+ * their own, aligned to HUGE_PAGE and advised for transparent huge pages,
+ * so that walking them takes a TLB entry per 2 MB instead of per 4 KB.
+ */
+#define HUGE_PAGE ((size_t) 2 << 20)
+
+/*
+ * The segment table is reserved up front for every 32-bit identifier, and
+ * the OS commits its pages as they are first touched. Mapping a segment
+ * then never moves the table. Where the reservation is refused, the table
+ * is malloc'd and doubled as needed.
+ */
+#define TABLE_ENTRIES ((size_t) 1 << 32)
+
+/*
+ * Once use_write_barrier is called, segment 0 is kept on pages of its own
+ * and write-protected, so that the decoded copy (and anything the watcher
+ * built from it) never has to be checked on an ordinary store. A store
+ * into segment 0 faults instead: the SIGSEGV handler marks the decoded
+ * entries of that page stale (see STALE_OPCODE), tells the watcher, and
+ * unprotects the page so the store can go ahead. The page is decoded and
+ * protected again by refresh_code when an interpreter next reaches it. A
+ * segment whose word 0 is not on a page boundary of its own buffer is
+ * copied to a code mapping laid out that way when it becomes segment 0.
+ *
+ * Without the barrier (the default, so that libum hosts keep SIGSEGV to
+ * themselves), WATCHED is added to the REFS of segment 0 instead: the
+ * check set_word already makes for shared segments then sends stores to it
+ * down the slow path, which decodes the word as it is stored.
+ *
+ * A page that faults VOLATILE_FAULTS times holds data the program keeps
+ * storing to, and a fault per store would cost far more than the store.
+ * That page alone is left writable and its words watched: segment 0 is
+ * WATCHED as well, and the slow path decodes a store to such a page and
+ * lets a store to any other page fault as before (see watched_word).
+ */
+#define VOLATILE_FAULTS 8
+#define WATCHED ((uint32_t) 1 << 31)
+static pthread_once_t barrier_once = PTHREAD_ONCE_INIT;
+static struct sigaction barrier_previous;
+static pthread_once_t page_once = PTHREAD_ONCE_INIT;
+static size_t page_size;
+
+/*
+ * The machine whose segment 0 faults are handled on each thread. The fault
+ * handler reads it, so it has the initial-exec model: in a shared library
+ * the default model may have __tls_get_addr allocate on a thread's first
+ * access, which is not safe in a signal handler.
+ */
+static __thread struct Data *barrier_machine
+        __attribute__((tls_model("initial-exec")));
+
+/*
+ * A program that load_program replaces is kept, with its decoded array, in
+ * a cache of up to CODE_CACHE_ENTRIES programs keyed by a fingerprint of
+ * their words, provided nothing was stored into it while it ran. Loading
+ * the same words again takes the segment and the array back out of the
+ * cache instead of mapping and decoding them anew. The least recently
+ * cached program is dropped to keep the cache within CODE_CACHE_BYTES.
+ */
+#define CODE_CACHE_ENTRIES 16
+#define CODE_CACHE_BYTES (64 << 20)
+
+struct Code_entry {
+        uint32_t *seg; /* Word 0 of the program, or NULL if the slot is free */
+        Instruction *decoded; /* Its decoded array, as set_fusion left it */
+        bool fused;
+        Fold *folds; /* and the constant runs it refers to */
+        uint32_t fold_count;
+        uint32_t fold_capacity;
+        uint32_t fold_free;
+        uint64_t hash; /* fingerprint of its words */
+        size_t block_bytes; /* Size of its code mapping, 0 if it has none */
+        uint64_t cached; /* When it was cached, to find the oldest */
+};
+
+/*
+ * With fusion on, a run of up to FOLD_MAX words of segment 0 that starts
+ * with load_val and only computes constants is folded into one entry (see
+ * fold_constants), which sets the registers the run leaves constant and
+ * skips it. A write the run overwrites before reading it is dropped, even
+ * if its value is not constant. Runs stay on their first word's page, so
+ * that refresh_code rebuilds them with the page, and are only folded on
+ * a protected page, as a store to a watched word (see watched_word) only
+ * refuses the entry before it. The three NANDs of an OR idiom are fused
+ * (FUSED_OR) under the same conditions.
+ */
+#define FOLD_MAX 32
+
+/*
+ * A folded entry keeps its load_val operands and holds the index of its
+ * Fold in the b and c it does not use, so there are at most MAX_FOLDS at
+ * a time; once they run out, runs are left unfolded until segment 0 is
+ * fused afresh. A Fold whose run is decoded or fused again is put on a
+ * free list (see release_fold), with length 0 and the next free index in
+ * head, and given out again before a new one is added.
+ */
+#define MAX_FOLDS (1 << 16)
+#define NO_FOLD UINT32_MAX
+
+/* Size of the machine's own console input and output buffers */
+#define IO_BUFFER (64 << 10)
+
+/*
+ * A snapshot file holds a Snapshot_header, one Snapshot_entry per segment
+ * table entry, and then each mapped segment (header words and words) at a
+ * 16-byte aligned offset. It is written in host byte order, so a restore
+ * can map the file and use the segments where they lie.
+ */
+#define SNAPSHOT_MAGIC "UMSNAP2"
+#define SNAPSHOT_ALIGN 16
+
+struct Snapshot_header {
+        char magic[8];
+        uint32_t registers[8];
+        uint32_t memory_index; /* pc of the input instruction */
+        uint32_t size; /* Entries in the segment table */
+        uint32_t free_head;
+        uint32_t unused;
+};
+
+struct Snapshot_entry {
+        uint64_t offset; /* Segment's header words, 0 if unmapped */
+        uint32_t length; /* Segment length, or next free identifier */
+        uint32_t unused;
+};
+
+/* struct Data
+*
+* a struct containing all relevant information pertaining to the Universal
+* Machine data
+*/
+struct T {
+        uint32_t **memory; /* Word 0 of each segment, or a FREE_ENTRY */
+        uint32_t free_head; /* Most recently unmapped identifier, 0 if none */
+        Instruction *decoded; /* Segment 0 with every word pre-decoded */
+        bool fused; /* decoded holds fused pairs (see set_fusion) */
+        Fold *folds; /* Constant runs FUSED_CONSTANTS entries refer to */
+        uint32_t fold_count;
+        uint32_t fold_capacity;
+        uint32_t fold_free; /* First Fold on the free list, or NO_FOLD */
+        uint64_t folded_runs; /* Runs folded by the last whole pass */
+        uint64_t or_idioms; /* ORs fused by it */
+        uint64_t words_removed; /* Dispatches the two save */
+        Code_watcher watcher; /* Told about changes to segment 0 */
+        void *watcher_cl;
+        uint8_t *code_start; /* Write-protected pages of segment 0 */
+        uint8_t *code_end;
+        uint8_t *code_block; /* Code mapping segment 0 lives in, or NULL */
+        size_t code_block_bytes;
+        uint8_t *code_spare; /* Code mapping kept for the next program */
+        size_t code_spare_bytes;
+        uint8_t *page_faults; /* Faults on each page, up to VOLATILE_FAULTS */
+        bool code_watched; /* Segment 0 is WATCHED: there is no barrier */
+        uint64_t code_faults; /* Pages unprotected by stores to them */
+        uint64_t code_hash; /* fingerprint of segment 0, 0 until needed */
+        bool code_clean; /* Segment 0 is unchanged since it was loaded */
+        struct Code_entry code_cache[CODE_CACHE_ENTRIES];
+        size_t code_cache_bytes; /* Words and decoded arrays held there */
+        uint64_t code_cache_clock; /* Programs cached so far */
+        uint64_t code_hits; /* Programs loaded from the cache */
+        uint64_t code_misses; /* Programs decoded because they were not */
+        void *pool[POOL_MAX_CLASS + 1]; /* Free lists of recycled segments */
+        size_t pool_bytes; /* Bytes held on the free lists */
+        uint64_t pool_hits; /* Allocations served from a free list */
+        uint64_t pool_misses; /* Allocations that went to malloc */
+        void *lazy[MAX_CLASS]; /* Free lists of emptied large mappings */
+        size_t lazy_bytes; /* Address space held on them */
+        size_t guard_page; /* Page size once guard_segments is called */
+        uint32_t huge_min; /* Segments this long go on huge pages, or 0 */
+        uint64_t huge_segments; /* Segments allocated on huge pages */
+
+        int output_fd; /* Where output instructions write */
+        bool output_batch; /* Flush only when full (not a console) */
+        bool output_lines; /* Flush at every newline (a terminal) */
+        size_t output_length; /* Bytes waiting in output */
+        int input_fd; /* Where input instructions read */
+        bool input_eof; /* input_fd has reached end of file */
+        size_t input_pos; /* Next unread byte in input */
+        size_t input_length; /* Bytes read into input */
+        Input_reader reader; /* Replaces read on input_fd if not NULL */
+        Output_writer writer; /* Replaces write on output_fd if not NULL */
+        void *io_cl;
+        uint8_t output[IO_BUFFER];
+        uint8_t input[IO_BUFFER];
+
+        const char *snapshot_path; /* Snapshot to write at blocking input */
+        uint8_t *restored; /* Mapped snapshot segments live in */
+        size_t restored_length;
+        uint32_t registers[8]; /* Array that holds all 8 registers */
+        int memory_index; /* Tracks the current word index in segment 0 */
+        uint32_t size; /* Identifiers in use in the segment table */
+        size_t capacity; /* Entries the segment table can hold */
+        bool table_reserved; /* Table is a TABLE_ENTRIES reservation */
+};
+
+/* * * * * * * * * * * * * * * * * size_class * * * * * * * * * * * * * * * *
+*
+* Returns the pool size class of a segment: the smallest k such that 2^k
+* words hold the segment and its header words.
+*
+* Parameters:
+*       uint32_t size:  number of words in the segment
+*
+* Return: the size class, which is above POOL_MAX_CLASS for segments too
+*         large to pool
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static inline int size_class(uint32_t size)
+{
+        uint64_t words = (uint64_t) size + HEADER_WORDS;
+
+        if (words <= (1 << POOL_MIN_CLASS)) {
+                return POOL_MIN_CLASS;
+        }
+        return 64 - __builtin_clzll(words - 1);
+}
+
+/* * * * * * * * * * * * * * * * * aligned_class * * * * * * * * * * * * * * *
+*
+* Tells whether the buffers of a size class start with a page of their own
+* in front of word 0 (see ALIGNED_MIN_PAGES).
+*
+* Parameters:
+*       int class:      a size class
+*
+* Return: true for every class of ALIGNED_MIN_PAGES pages or more, which
+*         includes every lazily zeroed class
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static inline bool aligned_class(int class)
+{
+        return (sizeof(uint32_t) << class) >= ALIGNED_MIN_PAGES * page_size;
+}
+
+/* Bytes in a pooled or lazily zeroed buffer of a size class */
+static inline size_t buffer_bytes(int class)
+{
+        return (sizeof(uint32_t) << class) +
+               (aligned_class(class) ? page_size : 0);
+}
+
+/* Word 0 of the segment held in a buffer of a size class */
+static inline uint32_t *buffer_segment(void *block, int class)
+{
+        if (aligned_class(class)) {
+                return (uint32_t *) ((uint8_t *) block + page_size);
+        }
+        return (uint32_t *) block + HEADER_WORDS;
+}
+
+/* The buffer of a size class that holds a segment */
+static inline void *segment_buffer(uint32_t *seg, int class)
+{
+        if (aligned_class(class)) {
+                return (uint8_t *) seg - page_size;
+        }
+        return seg - HEADER_WORDS;
+}
+
+/* * * * * * * * * * * * * * * * * segment_backing * * * * * * * * * * * * * *
+*
+* Returns how a segment of a given length is allocated: from a guarded
+* mapping, on huge pages, from a lazily zeroed mapping or from the pool.
+*
+* Parameters:
+*       T data:         UM data structure
+*       uint32_t size:  number of words in the segment
+*
+* Return: the segment's Backing
+*
+* Notes:
+*      new_segment and release_segment both go by this, so a policy must
+*      only change when no segment it would cover is mapped; guard_segments
+*      and set_huge_pages move those segments first
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static inline enum Backing segment_backing(T data, uint32_t size)
+{
+        if (data->guard_page != 0 && size >= GUARD_MIN_WORDS) {
+                return GUARDED;
+        }
+        if (data->huge_min != 0 && size >= data->huge_min) {
+                return HUGE;
+        }
+        if (size_class(size) > POOL_MAX_CLASS) {
+                return LAZY;
+        }
+        return POOLED;
+}
+
+/* Whether new_segment puts word 0 of a segment on a page of its own */
+static inline bool page_aligned_backing(T data, uint32_t size)
+{
+        enum Backing backing = segment_backing(data, size);
+
+        return backing == LAZY || backing == HUGE ||
+               (backing == POOLED && aligned_class(size_class(size)));
+}
+
+/* * * * * * * * * * * * * * * * new_guarded_segment * * * * * * * * * * * *
+*
+* Allocates a segment in a mapping of its own that ends in a guard page, so
+* that the word after the last one cannot be read or written.
+*
+* Parameters:
+*       T data:         UM data structure
+*       uint32_t size:  number of words in the segment
+*       size_t page:    the page size
+*
+* Return: pointer to word 0 of the new segment, whose words are zero
+*
+* Notes:
+*      The mapping is unmapped by release_segment, never pooled
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static uint32_t *new_guarded_segment(T data, uint32_t size, size_t page)
+{
+        size_t body = (((size_t) size + HEADER_WORDS) * sizeof(uint32_t) +
+                       page - 1) & ~(page - 1);
+        uint8_t *base = mmap(NULL, body + page, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        assert(base != MAP_FAILED);
+        mprotect(base + body, page, PROT_NONE);
+        data->pool_misses++;
+
+        uint32_t *seg = (uint32_t *) (base + body) - size;
+        LENGTH(seg) = size;
+        REFS(seg) = 1;
+        return seg;
+}
+
+/* * * * * * * * * * * * * * * * new_huge_segment * * * * * * * * * * * * * *
+*
+* Allocates a segment in a mapping of its own whose words start on a huge
+* page boundary and are advised for transparent huge pages. The header
+* words end the ordinary page in front of them.
+*
+* Parameters:
+*       T data:         UM data structure
+*       uint32_t size:  number of words in the segment
+*
+* Return: pointer to word 0 of the new segment, whose words are zero
+*
+* Notes:
+*      The words take a whole number of huge pages, which release_segment
+*      unmaps with the page in front. Whether the kernel backs them with
+*      huge pages is up to it; data_stats reports how much it did.
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static uint32_t *new_huge_segment(T data, uint32_t size)
+{
+        size_t bytes = ((size_t) size * sizeof(uint32_t) + HUGE_PAGE - 1) &
+                       ~(HUGE_PAGE - 1);
+        size_t mapped_bytes = page_size + bytes + HUGE_PAGE;
+
+        /* Map a huge page extra and trim it to an aligned range */
+        uint8_t *mapped = mmap(NULL, mapped_bytes, PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        assert(mapped != MAP_FAILED);
+        uint8_t *base = (uint8_t *) (((uintptr_t) mapped + page_size +
+                                      HUGE_PAGE - 1) & ~(HUGE_PAGE - 1));
+        if (base - page_size > mapped) {
+                munmap(mapped, base - page_size - mapped);
+        }
+        munmap(base + bytes, mapped + mapped_bytes - (base + bytes));
+        madvise(base, bytes, MADV_HUGEPAGE);
+
+        data->pool_misses++;
+        data->huge_segments++;
+
+        uint32_t *seg = (uint32_t *) base;
+        LENGTH(seg) = size;
+        REFS(seg) = 1;
+        return seg;
+}
+
+/* * * * * * * * * * * * * * * * new_lazy_segment * * * * * * * * * * * * * *
+*
+* Allocates a segment in an anonymous mapping of its size class, reusing
+* an emptied one when one is free.
+*
+* Parameters:
+*       T data:         UM data structure
+*       uint32_t size:  number of words in the segment
+*
+* Return: pointer to word 0 of the new segment, whose words are zero
+*
+* Notes:
+*      Pages are only backed by memory once they are touched, and the
+*      address space is reserved without swap (MAP_NORESERVE), so rounding
+*      up to a power of two costs nothing for pages never used. Word 0 is
+*      on a page boundary (see aligned_class).
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static uint32_t *new_lazy_segment(T data, uint32_t size)
+{
+        int class = size_class(size);
+        void *block = data->lazy[class];
+
+        if (block != NULL) {
+                data->lazy[class] = *(void **) block;
+                data->lazy_bytes -= buffer_bytes(class);
+                data->pool_hits++;
+        } else {
+                block = mmap(NULL, buffer_bytes(class),
+                             PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                             -1, 0);
+                assert(block != MAP_FAILED);
+                data->pool_misses++;
+        }
+
+        uint32_t *seg = buffer_segment(block, class);
+        LENGTH(seg) = size;
+        REFS(seg) = 1;
+        return seg;
+}
+
+/* * * * * * * * * * * * * * * * * new_segment * * * * * * * * * * * * * * *
+*
+* Allocates an unshared segment whose words are left uninitialized, reusing
+* a recycled buffer of the same size class when one is free.
+*
+* Parameters:
+*       T data:         UM data structure owning the segment pool
+*       uint32_t size:  number of words in the segment
+*
+* Return: pointer to word 0 of the new segment
+*
+* Notes:
+*      The segment is returned by release_segment once nothing shares it.
+*      Segments too large to pool get a mapping of their own (see
+*      segment_backing), whose words happen to be zero. Buffers of an
+*      aligned_class are allocated on a page boundary.
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static uint32_t *new_segment(T data, uint32_t size)
+{
+        switch (segment_backing(data, size)) {
+        case GUARDED:
+                return new_guarded_segment(data, size, data->guard_page);
+        case HUGE:
+                return new_huge_segment(data, size);
+        case LAZY:
+                return new_lazy_segment(data, size);
+        case POOLED:
+                break;
+        }
+
+        int class = size_class(size);
+        void *block;
+
+        if (data->pool[class] != NULL) {
+                block = data->pool[class];
+                data->pool[class] = *(void **) block;
+                data->pool_bytes -= buffer_bytes(class);
+                data->pool_hits++;
+        } else if (aligned_class(class)) {
+                int err = posix_memalign(&block, page_size,
+                                         buffer_bytes(class));
+                assert(err == 0);
+                data->pool_misses++;
+        } else {
+                block = malloc(buffer_bytes(class));
+                assert(block != NULL);
+                data->pool_misses++;
+        }
+
+        uint32_t *seg = buffer_segment(block, class);
+        LENGTH(seg) = size;
+        REFS(seg) = 1;
+        return seg;
+}
+
+/* * * * * * * * * * * * * * * * new_zeroed_segment * * * * * * * * * * * * *
+*
+* Allocates an unshared segment whose words are all zero, as map requires.
+*
+* Parameters:
+*       T data:         UM data structure owning the segment pool
+*       uint32_t size:  number of words in the segment
+*
+* Return: pointer to word 0 of the new segment
+*
+* Notes:
+*      Only pooled buffers are cleared here; every other backing is a
+*      mapping that the kernel zero-fills as it is touched
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static uint32_t *new_zeroed_segment(T data, uint32_t size)
+{
+        uint32_t *seg = new_segment(data, size);
+
+        if (segment_backing(data, size) == POOLED) {
+                memset(seg, 0, size * sizeof(uint32_t));
+        }
+        return seg;
+}
+
+/* * * * * * * * * * * * * * * * new_code_segment * * * * * * * * * * * * * *
+*
+* Allocates a segment to become segment 0, whose words start on a page
+* boundary and share their pages with nothing else, so that they can be
+* write-protected on their own. The header words end the page in front.
+*
+* Parameters:
+*       T data:         UM data structure
+*       uint32_t size:  number of words in the segment
+*
+* Return: pointer to word 0 of the new segment, whose words are left for
+*         the caller to fill in
+*
+* Expects:
+*      data has no code mapping
+*
+* Notes:
+*      A size whose new_segment buffer is laid out that way already takes
+*      one, as does any size without the barrier. Otherwise the segment
+*      gets a code mapping, which is the spare one kept by release_segment
+*      if that is large enough, so a program loaded again and again does
+*      not map and unmap its pages each time.
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static uint32_t *new_code_segment(T data, uint32_t size)
+{
+        if (data->code_watched || page_aligned_backing(data, size)) {
+                return new_segment(data, size);
+        }
+        assert(data->code_block == NULL);
+
+        size_t bytes = page_size + (((size_t) size * sizeof(uint32_t) +
+                                     page_size - 1) & ~(page_size - 1));
+        uint8_t *block = data->code_spare;
+
+        if (block != NULL && data->code_spare_bytes >= bytes) {
+                bytes = data->code_spare_bytes;
+                data->code_spare = NULL;
+                data->pool_hits++;
+        } else {
+                block = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                assert(block != MAP_FAILED);
+                data->pool_misses++;
+        }
+        data->code_block = block;
+        data->code_block_bytes = bytes;
+
+        uint32_t *seg = (uint32_t *) (block + page_size);
+        LENGTH(seg) = size;
+        REFS(seg) = 1;
+        return seg;
+}
+
+/* Whether a segment lives in the code mapping of data */
+static inline bool in_code_block(T data, uint32_t *seg)
+{
+        return data->code_block != NULL &&
+               (uint8_t *) seg == data->code_block + page_size;
+}
+
+/* * * * * * * * * * * * * * * * * release_segment * * * * * * * * * * * * * *
+*
+* Drops one segment table entry's reference to a segment. The last
+* reference puts the buffer on its size class's free list, emptied first
+* if it is a lazily zeroed mapping, or frees it if the list is full or the
+* segment has a mapping of its own.
+*
+* Parameters:
+*       T data:         UM data structure owning the segment pool
+*       uint32_t *seg:  word 0 of the segment
+*
+* Return: nothing
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static void release_segment(T data, uint32_t *seg)
+{
+        if (--REFS(seg) != 0) {
+                return;
+        }
+
+        /* Segments restored from a snapshot belong to its mapping */
+        if ((uint8_t *) seg >= data->restored &&
+            (uint8_t *) seg < data->restored + data->restored_length) {
+                return;
+        }
+        if (in_code_block(data, seg)) {
+                /* Keep the larger of it and the spare for the next one */
+                if (data->code_spare != NULL &&
+                    data->code_spare_bytes >= data->code_block_bytes) {
+                        munmap(data->code_block, data->code_block_bytes);
+                } else {
+                        if (data->code_spare != NULL) {
+                                munmap(data->code_spare,
+                                       data->code_spare_bytes);
+                        }
+                        data->code_spare = data->code_block;
+                        data->code_spare_bytes = data->code_block_bytes;
+                }
+                data->code_block = NULL;
+                return;
+        }
+
+        int class = size_class(LENGTH(seg));
+        size_t bytes = buffer_bytes(class);
+        void *block = segment_buffer(seg, class);
+        uint8_t *end, *base;
+
+        switch (segment_backing(data, LENGTH(seg))) {
+        case GUARDED:
+                end = (uint8_t *) (seg + LENGTH(seg));
+                base = (uint8_t *) ((uintptr_t) (seg - HEADER_WORDS) &
+                                    ~(data->guard_page - 1));
+                munmap(base, end - base + data->guard_page);
+                break;
+        case HUGE:
+                bytes = ((size_t) LENGTH(seg) * sizeof(uint32_t) +
+                         HUGE_PAGE - 1) & ~(HUGE_PAGE - 1);
+                munmap((uint8_t *) seg - page_size, page_size + bytes);
+                break;
+        case LAZY:
+                if (data->lazy_bytes + bytes > LAZY_LIMIT) {
+                        munmap(block, bytes);
+                        break;
+                }
+                madvise(block, bytes, MADV_DONTNEED);
+                *(void **) block = data->lazy[class];
+                data->lazy[class] = block;
+                data->lazy_bytes += bytes;
+                break;
+        case POOLED:
+                if (data->pool_bytes + bytes > POOL_LIMIT) {
+                        free(block);
+                        break;
+                }
+                *(void **) block = data->pool[class];
+                data->pool[class] = block;
+                data->pool_bytes += bytes;
+                break;
+        }
+}
+
+/* * * * * * * * * * * * * * * * * on_code_write * * * * * * * * * * * * * * *
+*
+* SIGSEGV handler of the write barrier: lets a store into segment 0 go
+* ahead after invalidating its page, and passes any other fault on to the
+* handler installed before it.
+*
+* Parameters:
+*      int signal:          SIGSEGV
+*      siginfo_t *info:     holds the faulting address
+*      void *context:       passed on
+*
+* Return: nothing; the faulting instruction runs again
+*
+* Notes:
+*      With no previous handler, the default action is restored, so the
+*      fault repeats and kills the process as it would have
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static void on_code_write(int signal, siginfo_t *info, void *context)
+{
+        if (code_write_fault(info->si_addr)) {
+                return;
+        }
+
+        if (barrier_previous.sa_flags & SA_SIGINFO) {
+                barrier_previous.sa_sigaction(signal, info, context);
+        } else if (barrier_previous.sa_handler != SIG_DFL &&
+                   barrier_previous.sa_handler != SIG_IGN) {
+                barrier_previous.sa_handler(signal);
+        } else {
+                struct sigaction action;
+                memset(&action, 0, sizeof(action));
+                action.sa_handler = SIG_DFL;
+                sigaction(signal, &action, NULL);
+        }
+}
+
+/* * * * * * * * * * * * * * * * * start_barrier * * * * * * * * * * * * * * *
+*
+* Installs on_code_write, once per process.
+*
+* Parameters: none
+*
+* Return: nothing
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static void start_barrier(void)
+{
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_sigaction = on_code_write;
+        action.sa_flags = SA_SIGINFO;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGSEGV, &action, &barrier_previous);
+}
+
+/* Reads the page size, once per process, before any segment is made */
+static void find_page_size(void)
+{
+        page_size = sysconf(_SC_PAGESIZE);
+}
+
+/* * * * * * * * * * * * * * * * * unprotect_code * * * * * * * * * * * * * *
+*
+* Makes the pages of segment 0 writable again, or takes WATCHED off it,
+* before segment 0 is released or moved.
+*
+* Parameters:
+*       T data:         UM data structure
+*
+* Return: nothing
+*
+* Notes:
+*      Stale decoded entries stay stale; refresh_code decodes them from
+*      wherever segment 0 is by then
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static void unprotect_code(T data)
+{
+        REFS(data->memory[0]) &= ~WATCHED;
+        if (data->code_start != NULL) {
+                mprotect(data->code_start, data->code_end - data->code_start,
+                         PROT_READ | PROT_WRITE);
+                data->code_start = NULL;
+                data->code_end = NULL;
+        }
+}
+
+/* * * * * * * * * * * * * * * * * protect_code * * * * * * * * * * * * * * *
+*
+* Write-protects the pages of a newly installed segment 0, or marks it
+* WATCHED if the barrier is not in use. A segment whose words start on a
+* page boundary of their own buffer is protected where it is; any other is
+* first moved to a code mapping.
+*
+* Parameters:
+*       T data:         UM data structure whose segment 0 was just set
+*
+* Return: nothing
+*
+* Expects:
+*      unprotect_code was called before segment 0 was changed
+*
+* Notes:
+*      The header words are on the page in front, which is never
+*      protected, so sharing and releasing segment 0 do not fault. The
+*      segment may be shared with its load_program source; set_word copies
+*      a shared segment before storing to it. Every page is protected
+*      again, even one left writable before.
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static void protect_code(T data)
+{
+        barrier_machine = data;
+
+        if (data->code_watched) {
+                REFS(data->memory[0]) |= WATCHED;
+                return;
+        }
+
+        uint32_t *seg = data->memory[0];
+        uint32_t size = LENGTH(seg);
+        bool restored = (uint8_t *) seg >= data->restored &&
+                        (uint8_t *) seg < data->restored +
+                                          data->restored_length;
+
+        if (!in_code_block(data, seg) &&
+            (restored || !page_aligned_backing(data, size))) {
+                uint32_t *copy = new_code_segment(data, size);
+                memcpy(copy, seg, size * sizeof(uint32_t));
+                release_segment(data, seg);
+                data->memory[0] = copy;
+                seg = copy;
+        }
+
+        data->code_start = (uint8_t *) seg;
+        data->code_end = (uint8_t *) (((uintptr_t) (seg + size) +
+                                       page_size - 1) & ~(page_size - 1));
+        mprotect(data->code_start, data->code_end - data->code_start,
+                 PROT_READ);
+
+        /* Pages line up with other words than before, so start counting */
+        free(data->page_faults);
+        data->page_faults = calloc((data->code_end - data->code_start) /
+                                   page_size + 1, sizeof(uint8_t));
+        assert(data->page_faults != NULL);
+}
+
+/* * * * * * * * * * * * * * * * * unshare_segment * * * * * * * * * * * * * *
+*
+* Gives a segment table entry its own copy of a segment it shares.
+*
+* Parameters:
+*       T data:                 UM data structure
+*       int segment_index:      entry whose segment is shared
+*
+* Return: pointer to word 0 of the private copy
+*
+* Notes:
+*      The other sharers keep the original, so decoded or compiled forms of
+*      segment 0 stay valid whichever side is copied
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static uint32_t *unshare_segment(T data, int segment_index)
+{
+        uint32_t *seg = data->memory[segment_index];
+        uint32_t size = LENGTH(seg);
+
+        /* Segment 0's copy goes on pages of its own and is protected */
+        if (segment_index != 0) {
+                uint32_t *copy = new_segment(data, size);
+                memcpy(copy, seg, size * sizeof(uint32_t));
+                release_segment(data, seg);
+                data->memory[segment_index] = copy;
+                return copy;
+        }
+
+        unprotect_code(data);
+        uint32_t *copy = new_code_segment(data, size);
+        memcpy(copy, seg, size * sizeof(uint32_t));
+        release_segment(data, seg);
+        data->memory[0] = copy;
+        protect_code(data);
+        return copy;
+}
+
+/* * * * * * * * * * * * * * * * * decode_word * * * * * * * * * * * * * * *
+*
+* Unpacks the opcode and operands of a single instruction word.
+*
+* Parameters:
+*       Instruction *ins:       decoded entry to fill in
+*       uint32_t word:          raw instruction word
+*
+* Return: nothing
+*
+* Expects:
+*      ins is not null
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static inline void decode_word(Instruction *ins, uint32_t word)
+{
+        ins->opcode = word >> 28;
+
+        if (ins->opcode == 13) {
+                ins->a = (word & 0xE000000) >> 25;
+                ins->b = 0;
+                ins->c = 0;
+                ins->value = word & 0x1FFFFFF;
+        } else {
+                ins->a = (word & 0x1C0) >> 6;
+                ins->b = (word & 0x38) >> 3;
+                ins->c = word & 0x7;
+                ins->value = 0;
+        }
+}
+
+/* Whether stores to a word of segment 0 are decoded as they are made */
+static inline bool watched_word(T data, uint32_t word_index)
+{
+        return data->code_watched ||
+               data->page_faults[word_index / (page_size / sizeof(uint32_t))]
+               >= VOLATILE_FAULTS;
+}
+
+/* * * * * * * * * * * * * * * * * page_words * * * * * * * * * * * * * * * *
+*
+* Finds the words of a segment that lie on a page.
+*
+* Parameters:
+*      uint32_t *seg:      word 0 of the segment
+*      uintptr_t page:     address of the page, which overlaps the segment
+*      uint32_t *first:    set to the first word on the page
+*      uint32_t *end:      set to one past the last word on the page
+*
+* Return: Nothing
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static void page_words(uint32_t *seg, uintptr_t page, uint32_t *first,
+                       uint32_t *end)
+{
+        uintptr_t start = (uintptr_t) seg;
+        uint64_t last = (page + page_size - start) / sizeof(uint32_t);
+
+        *first = page <= start ? 0 : (page - start) / sizeof(uint32_t);
+        *end = last < LENGTH(seg) ? last : LENGTH(seg);
+}
+
+/* * * * * * * * * * * * * * * * * release_fold * * * * * * * * * * * * * * *
+*
+* Puts the Fold of a folded entry on the free list, before the entry is
+* decoded or fused again.
+*
+* Parameters:
+*       T data:                 Data structure
+*       uint32_t word_index:    entry of segment 0, folded, stale or plain
+*
+* Return: nothing
+*
+* Notes:
+*      A stale entry keeps the b and c it had, so its Fold is still found.
+*      The Fold's head tells a folded entry from a plain one whose b and c
+*      happen to name a Fold in use.
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static void release_fold(T data, uint32_t word_index)
+{
+        Instruction *ins = &data->decoded[word_index];
+        uint32_t k = ins->b | ins->c << 8;
+
+        if ((ins->opcode != FUSED_CONSTANTS && ins->opcode != STALE_OPCODE) ||
+            k >= data->fold_count || data->folds[k].length == 0 ||
+            data->folds[k].head != word_index) {
+                return;
+        }
+        data->folds[k].length = 0;
+        data->folds[k].head = data->fold_free;
+        data->fold_free = k;
+}
+
+/* * * * * * * * * * * * * * * * * fold_constants * * * * * * * * * * * * * *
+*
+* Folds the longest run of words from a load_val that computes only
+* constants into its first entry, as FUSED_CONSTANTS.
+*
+* Parameters:
+*       T data:                 Data structure with fusion on, whose
+*                               segment 0 is protected
+*       uint32_t word_index:    entry of segment 0 to start the run at
+*
+* Return: true if a run of at least three words was folded, false if the
+*         entry was left alone
+*
+* Notes:
+*      Each register is tracked as constant, untouched, or dead: written
+*      with a value not known here. A run may not read a dead register and
+*      only ends where none is dead, so the registers it leaves changed
+*      all hold constants. Division by zero, or by a value not known here,
+*      ends a run, so as not to fold away a fault. A Fold on the free list
+*      is reused first; nothing is folded once MAX_FOLDS are in use.
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static bool fold_constants(T data, uint32_t word_index)
+{
+        uint32_t *seg = data->memory[0];
+        uint32_t first, end;
+        uint32_t values[8] = { 0 };
+        uint8_t known = 0, dead = 0;
+        Fold fold = { .mask = 0, .length = 0 };
+
+        if (seg[word_index] >> 28 != 13) {
+                return false;
+        }
+        page_words(seg, (uintptr_t) (seg + word_index) & ~(page_size - 1),
+                   &first, &end);
+        if (end > word_index + FOLD_MAX) {
+                end = word_index + FOLD_MAX;
+        }
+
+        for (uint32_t i = word_index; i < end; i++) {
+                uint32_t word = seg[i];
+                unsigned opcode = word >> 28;
+                unsigned a = (word >> 6) & 7, b = (word >> 3) & 7;
+                unsigned c = word & 7;
+                uint8_t reads = (1 << b) | (1 << c);
+
+                if (opcode == 13) {
+                        a = (word >> 25) & 7;
+                        values[a] = word & 0x1FFFFFF;
+                        known |= 1 << a;
+                        dead &= ~(1 << a);
+                } else if (opcode == 0 || (opcode >= 3 && opcode <= 6)) {
+                        if (opcode == 0) {
+                                reads |= 1 << a;
+                        }
+                        if ((reads & dead) != 0) {
+                                break;
+                        }
+
+                        bool constant = (reads & known) == reads;
+                        uint32_t x = values[b], y = values[c];
+                        if (opcode == 5 && (!constant || y == 0)) {
+                                break;
+                        }
+                        if (opcode == 0 && ((known >> c) & 1) != 0) {
+                                /* A move known to be taken, or not */
+                                if (y == 0) {
+                                        goto next;
+                                }
+                                constant = ((known >> b) & 1) != 0;
+                        }
+
+                        if (constant) {
+                                values[a] = opcode == 0 ? x :
+                                            opcode == 3 ? x + y :
+                                            opcode == 4 ? x * y :
+                                            opcode == 5 ? x / y :
+                                                          ~(x & y);
+                                known |= 1 << a;
+                                dead &= ~(1 << a);
+                        } else {
+                                known &= ~(1 << a);
+                                dead |= 1 << a;
+                        }
+                } else {
+                        break;
+                }
+next:
+                if (dead == 0) {
+                        fold.length = i + 1 - word_index;
+                        fold.mask = known;
+                        memcpy(fold.values, values, sizeof(values));
+                }
+        }
+
+        if (fold.length < 3 || (data->fold_free == NO_FOLD &&
+                                data->fold_count == MAX_FOLDS)) {
+                return false;
+        }
+
+        uint32_t k = data->fold_free;
+        if (k != NO_FOLD) {
+                data->fold_free = data->folds[k].head;
+        } else {
+                if (data->fold_count == data->fold_capacity) {
+                        data->fold_capacity = data->fold_capacity * 2 + 16;
+                        data->folds = realloc(data->folds,
+                                              data->fold_capacity *
+                                              sizeof(Fold));
+                        assert(data->folds != NULL);
+                }
+                k = data->fold_count++;
+        }
+
+        fold.head = word_index;
+        data->folds[k] = fold;
+        data->decoded[word_index].opcode = FUSED_CONSTANTS;
+        data->decoded[word_index].b = k & 0xFF;
+        data->decoded[word_index].c = k >> 8;
+        return true;
+}
+
+/* * * * * * * * * * * * * * * * * fuse_or * * * * * * * * * * * * * * * * *
+*
+* Fuses the three NANDs of an OR from an entry of segment 0, as FUSED_OR:
+* NOT x into t1, NOT y into t2, then the NAND of t1 and t2.
+*
+* Parameters:
+*       T data:                 Data structure with fusion on, whose
+*                               segment 0 is protected
+*       uint32_t word_index:    entry of segment 0 to start at
+*
+* Return: true if the entry was fused, false if it was left alone
+*
+* Notes:
+*      t1 and t2 are still written, as the program may read them. The
+*      second NOT must not read t1, and t1 and t2 must differ, so that the
+*      interpreter can read x and y up front and write x | y.
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static bool fuse_or(T data, uint32_t word_index)
+{
+        uint32_t *seg = data->memory[0];
+        uint32_t first, end;
+
+        page_words(seg, (uintptr_t) (seg + word_index) & ~(page_size - 1),
+                   &first, &end);
+        if (word_index + 3 > end) {
+                return false;
+        }
+
+        Instruction not_x, not_y, nand;
+        decode_word(&not_x, seg[word_index]);
+        decode_word(&not_y, seg[word_index + 1]);
+        decode_word(&nand, seg[word_index + 2]);
+
+        if (not_x.opcode != 6 || not_y.opcode != 6 || nand.opcode != 6 ||
+            not_x.b != not_x.c || not_y.b != not_y.c ||
+            not_y.b == not_x.a || not_x.a == not_y.a) {
+                return false;
+        }
+        if (!((nand.b == not_x.a && nand.c == not_y.a) ||
+              (nand.b == not_y.a && nand.c == not_x.a))) {
+                return false;
+        }
+
+        data->decoded[word_index].opcode = FUSED_OR;
+        return true;
+}
+
+/* * * * * * * * * * * * * * * * * fuse_word * * * * * * * * * * * * * * * *
+*
+* Sets the opcode of a decoded entry of segment 0 from its word and the
+* next one: a fused opcode if the pair is one the interpreter runs as a
+* single dispatch, the word's own opcode otherwise. While segment 0 is
+* protected, a folded constant run or an OR idiom comes first.
+*
+* Parameters:
+*       T data:                 Data structure with fusion on
+*       uint32_t word_index:    entry of segment 0 to set
+*
+* Return: nothing
+*
+* Notes:
+*      Only the opcode changes (and the unused b and c of a load_val that
+*      is folded), so the operands of both words stay usable. The pair
+*      depends on the next word too, so a store to a word must refuse the
+*      one before it as well. A pair whose second entry is stale is not
+*      fused, as its operands are out of date.
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static void fuse_word(T data, uint32_t word_index)
+{
+        uint32_t *seg = data->memory[0];
+        uint32_t size = LENGTH(seg);
+
+        release_fold(data, word_index);
+        if (!watched_word(data, word_index) &&
+            (fold_constants(data, word_index) || fuse_or(data, word_index))) {
+                return;
+        }
+
+        uint8_t first = seg[word_index] >> 28;
+        uint8_t second = word_index + 1 < size ? seg[word_index + 1] >> 28
+                                               : 7;
+        uint8_t opcode = first;
+
+        if (data->decoded[word_index + 1].opcode == STALE_OPCODE) {
+                second = 7;
+        }
+
+        if (first == 13) {
+                switch (second) {
+                case 13:
+                        opcode = FUSED_LOADVAL_LOADVAL;
+                        break;
+                case 1:
+                        opcode = FUSED_LOADVAL_LOAD;
+                        break;
+                case 2:
+                        opcode = FUSED_LOADVAL_STORE;
+                        break;
+                case 12:
+                        opcode = FUSED_LOADVAL_LOADPROG;
+                        break;
+                }
+        } else if (first == 6 && second == 6) {
+                opcode = FUSED_NAND_NAND;
+        }
+
+        data->decoded[word_index].opcode = opcode;
+}
+
+/* Words of segment 0 that a fused entry runs in one dispatch */
+static inline uint32_t fused_length(T data, uint32_t word_index)
+{
+        Instruction *ins = &data->decoded[word_index];
+
+        if (ins->opcode == FUSED_CONSTANTS) {
+                return data->folds[ins->b | ins->c << 8].length;
+        }
+        return ins->opcode == FUSED_OR ? 3 : 1;
+}
+
+/* * * * * * * * * * * * * * * * * fuse_segment_0 * * * * * * * * * * * * * *
+*
+* Fuses every entry of segment 0 that is not stale, and counts the constant
+* runs folded and the ORs fused for data_stats.
+*
+* Parameters:
+*       T data:         Data structure with fusion on
+*
+* Return: nothing
+*
+* Notes:
+*      The constant runs are folded afresh, so earlier indices into
+*      data->folds are given out again. The counts are this pass's alone.
+*      The words a run or OR covers are not fused themselves, so runs are
+*      never folded inside one another.
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static void fuse_segment_0(T data)
+{
+        uint32_t size = LENGTH(data->memory[0]);
+
+        data->fold_count = 0;
+        data->fold_free = NO_FOLD;
+        data->folded_runs = 0;
+        data->or_idioms = 0;
+        data->words_removed = 0;
+        for (uint32_t i = 0; i < size; i++) {
+                Instruction *ins = &data->decoded[i];
+                if (ins->opcode == STALE_OPCODE) {
+                        continue;
+                }
+
+                fuse_word(data, i);
+                uint32_t covered = fused_length(data, i);
+                if (ins->opcode == FUSED_CONSTANTS) {
+                        data->folded_runs++;
+                } else if (ins->opcode == FUSED_OR) {
+                        data->or_idioms++;
+                }
+                data->words_removed += covered - 1;
+                i += covered - 1;
+        }
+}
+
+/* * * * * * * * * * * * * * * * * decode_segment_0 * * * * * * * * * * * * *
+*
+* Rebuilds the decoded copy of segment 0 after a new program is installed.
+*
+* Parameters:
+*       T data:         Data structure whose segment 0 was just replaced
+*
+* Return: nothing
+*
+* Expects:
+*      T data is not null and data->memory[0] is mapped
+*
+* Notes:
+*      The previous decoded array is freed, so pointers handed out by
+*      decoded_segment_zero are no longer valid afterwards. Segment 0 is
+*      write-protected (and may move to do so) first.
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static void decode_segment_0(T data)
+{
+        protect_code(data);
+
+        uint32_t *seg = data->memory[0];
+        uint32_t size = LENGTH(seg);
+
+        free(data->decoded);
+        /* One extra entry halts a program that runs off its end */
+        data->decoded = malloc((size + 1) * sizeof(Instruction));
+        assert(data->decoded != NULL);
+
+        for (uint32_t i = 0; i < size; i++) {
+                decode_word(&data->decoded[i], seg[i]);
+        }
+        decode_word(&data->decoded[size], 0x70000000);
+
+        /* The old program's Folds go with it */
+        data->fold_count = 0;
+        data->fold_free = NO_FOLD;
+        if (data->fused) {
+                fuse_segment_0(data);
+        }
+}
+
+/* * * * * * * * * * * * * * * * * fingerprint * * * * * * * * * * * * * * * *
+*
+* Hashes the words of a segment, to tell programs in the code cache apart.
+*
+* Parameters:
+*       const uint32_t *words:  word 0 of the segment
+*       uint32_t size:          number of words
+*
+* Return: a 64-bit hash of size and the words
+*
+* Notes:
+*      Four pairs of words are mixed in at a time, into four independent
+*      hashes, so that the multiplies overlap. Equal hashes are only a hint;
+*      take_cached_code compares the words as well.
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static uint64_t fingerprint(const uint32_t *words, uint32_t size)
+{
+        const uint64_t k = 0x9E3779B97F4A7C15;
+        uint64_t h[4] = { size, size ^ k, size + k, ~(uint64_t) size };
+        uint32_t i = 0;
+
+        for (; i + 8 <= size; i += 8) {
+                for (int lane = 0; lane < 4; lane++) {
+                        uint64_t pair;
+                        memcpy(&pair, words + i + 2 * lane, sizeof(pair));
+                        h[lane] = (h[lane] ^ pair) * k;
+                        h[lane] ^= h[lane] >> 29;
+                }
+        }
+        for (; i < size; i++) {
+                h[0] = (h[0] ^ words[i]) * k;
+                h[0] ^= h[0] >> 29;
+        }
+
+        return ((h[0] * k ^ h[1]) * k ^ h[2]) * k ^ h[3];
+}
+
+/* Bytes a program of size words with room for folds runs holds cached */
+static inline size_t cached_bytes(uint32_t size, uint32_t folds)
+{
+        return (size_t) size * sizeof(uint32_t) +
+               ((size_t) size + 1) * sizeof(Instruction) +
+               (size_t) folds * sizeof(Fold);
+}
+
+/* * * * * * * * * * * * * * * * * drop_cached_code * * * * * * * * * * * * *
+*
+* Frees a program held in the code cache and empties its slot.
+*
+* Parameters:
+*       T data:                         UM data structure
+*       struct Code_entry *entry:       slot holding the program
+*
+* Return: nothing
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static void drop_cached_code(T data, struct Code_entry *entry)
+{
+        data->code_cache_bytes -= cached_bytes(LENGTH(entry->seg),
+                                              entry->fold_capacity);
+        if (entry->block_bytes != 0) {
+                munmap((uint8_t *) entry->seg - page_size,
+                       entry->block_bytes);
+        } else {
+                release_segment(data, entry->seg);
+        }
+        free(entry->decoded);
+        free(entry->folds);
+        entry->seg = NULL;
+        entry->decoded = NULL;
+        entry->folds = NULL;
+}
+
+/* * * * * * * * * * * * * * * * * flush_code_cache * * * * * * * * * * * * *
+*
+* Frees every program held in the code cache.
+*
+* Parameters:
+*       T data:         UM data structure
+*
+* Return: nothing
+*
+* Notes:
+*      Cached segments are released by the backing policy they were
+*      allocated under, so the cache is flushed before the policy changes
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static void flush_code_cache(T data)
+{
+        for (int i = 0; i < CODE_CACHE_ENTRIES; i++) {
+                if (data->code_cache[i].seg != NULL) {
+                        drop_cached_code(data, &data->code_cache[i]);
+                }
+        }
+}
+
+/* * * * * * * * * * * * * * * * * cache_segment_0 * * * * * * * * * * * * * *
+*
+* Moves segment 0 and its decoded array into the code cache as it is being
+* replaced, if it is unchanged since it was loaded and nothing else shares
+* it, dropping the oldest programs to make room.
+*
+* Parameters:
+*       T data:         UM data structure whose segment 0 is unprotected
+*
+* Return: true if segment 0 was cached, and now belongs to the cache along
+*         with data->decoded (set to NULL); false if the caller still has
+*         to release it
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static bool cache_segment_0(T data)
+{
+        uint32_t *seg = data->memory[0];
+        size_t bytes = cached_bytes(LENGTH(seg), data->fold_capacity);
+
+        if (!data->code_clean || REFS(seg) != 1 || bytes > CODE_CACHE_BYTES) {
+                return false;
+        }
+        if (data->code_hash == 0) {
+                data->code_hash = fingerprint(seg, LENGTH(seg));
+        }
+
+        struct Code_entry *slot = NULL;
+        for (;;) {
+                struct Code_entry *oldest = NULL;
+                slot = NULL;
+                for (int i = 0; i < CODE_CACHE_ENTRIES; i++) {
+                        struct Code_entry *entry = &data->code_cache[i];
+                        if (entry->seg == NULL) {
+                                slot = entry;
+                        } else if (oldest == NULL ||
+                                   entry->cached < oldest->cached) {
+                                oldest = entry;
+                        }
+                }
+                if (slot != NULL &&
+                    data->code_cache_bytes + bytes <= CODE_CACHE_BYTES) {
+                        break;
+                }
+                drop_cached_code(data, oldest);
+        }
+
+        slot->seg = seg;
+        slot->decoded = data->decoded;
+        slot->fused = data->fused;
+        slot->folds = data->folds;
+        slot->fold_count = data->fold_count;
+        slot->fold_capacity = data->fold_capacity;
+        slot->fold_free = data->fold_free;
+        slot->hash = data->code_hash;
+        slot->block_bytes = 0;
+        slot->cached = ++data->code_cache_clock;
+        if (in_code_block(data, seg)) {
+                slot->block_bytes = data->code_block_bytes;
+                data->code_block = NULL;
+        }
+        data->code_cache_bytes += bytes;
+        data->decoded = NULL;
+        data->folds = NULL;
+        data->fold_count = 0;
+        data->fold_capacity = 0;
+        data->fold_free = NO_FOLD;
+        return true;
+}
+
+/* * * * * * * * * * * * * * * * * take_cached_code * * * * * * * * * * * * *
+*
+* Installs a program from the code cache as segment 0 if it holds one with
+* the same words as a segment about to be loaded.
+*
+* Parameters:
+*       T data:         UM data structure whose segment 0 was released
+*       uint32_t *seg:  segment being loaded
+*
+* Return: true if segment 0 and its decoded array came from the cache (and
+*         still have to be protected), false if seg has to be loaded
+*
+* Notes:
+*      The cached copy is taken out of the cache, so seg keeps its own
+*      words and is not shared with segment 0. seg is only hashed if a
+*      cached program has its length; data->code_hash is set to the hash,
+*      or to 0 if there was none to compare.
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static bool take_cached_code(T data, uint32_t *seg)
+{
+        uint32_t size = LENGTH(seg);
+
+        data->code_hash = 0;
+        for (int i = 0; i < CODE_CACHE_ENTRIES; i++) {
+                struct Code_entry *entry = &data->code_cache[i];
+                if (entry->seg == NULL || LENGTH(entry->seg) != size) {
+                        continue;
+                }
+                if (data->code_hash == 0) {
+                        data->code_hash = fingerprint(seg, size);
+                }
+                if (entry->hash != data->code_hash ||
+                    memcmp(entry->seg, seg, size * sizeof(uint32_t)) != 0) {
+                        continue;
+                }
+
+                free(data->decoded);
+                free(data->folds);
+                data->memory[0] = entry->seg;
+                data->decoded = entry->decoded;
+                data->folds = entry->folds;
+                data->fold_count = entry->fold_count;
+                data->fold_capacity = entry->fold_capacity;
+                data->fold_free = entry->fold_free;
+                if (entry->block_bytes != 0) {
+                        data->code_block = (uint8_t *) entry->seg -
+                                           page_size;
+                        data->code_block_bytes = entry->block_bytes;
+                }
+
+                /* Entries are in the form set_fusion last asked for */
+                bool fused = data->fused;
+                data->fused = entry->fused;
+                set_fusion(data, fused);
+
+                data->code_cache_bytes -= cached_bytes(size,
+                                                      entry->fold_capacity);
+                entry->seg = NULL;
+                entry->decoded = NULL;
+                entry->folds = NULL;
+                data->code_hits++;
+                return true;
+        }
+
+        data->code_misses++;
+        return false;
+}
+
+/* * * * * * * * * * * * * * * * * swap_words * * * * * * * * * * * * * * * *
+*
+* Converts big-endian 32-bit words from a byte buffer into host words.
+*
+* Parameters:
+*       uint32_t *words:        destination, n words
+*       const uint8_t *bytes:   source, 4 * n bytes in UM (big-endian) order
+*       size_t n:               number of words
+*
+* Return: nothing
+*
+* Notes:
+*      On SSE2 hosts four words are swapped per step: bytes are swapped
+*      within each 16-bit half, then the two halves of each word
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static void swap_words(uint32_t *words, const uint8_t *bytes, size_t n)
+{
+        size_t i = 0;
+
+#if defined(__SSE2__)
+        for (; i + 4 <= n; i += 4) {
+                __m128i v = _mm_loadu_si128((const __m128i *) (bytes + 4 * i));
+
+                v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+                v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+                v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+                _mm_storeu_si128((__m128i *) (words + i), v);
+        }
+#endif
+        for (; i < n; i++) {
+                const uint8_t *b = bytes + 4 * i;
+                words[i] = (uint32_t) b[0] << 24 | (uint32_t) b[1] << 16 |
+                           (uint32_t) b[2] << 8 | (uint32_t) b[3];
+        }
+}
+
+/* * * * * * * * * * * * * * * * * load_program_bytes * * * * * * * * * * * *
+*
+* Installs a UM binary image held in memory as segment 0.
+*
+* Parameters:
+*       T data:                 initialized Data structure
+*       const uint8_t *bytes:   the program, as read from a .um file
+*       size_t length:          number of bytes in the program
+*
+* Return: nothing
+*
+* Expects:
+*      T data is not null, bytes is not null unless length is 0, and
+*      length is a multiple of 4
+*
+* Notes:
+*      Segment 0 is sized exactly and freed in data_free
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static void load_program_bytes(T data, const uint8_t *bytes, size_t length)
+{
+        uint32_t size = length / 4;
+        uint32_t *seg = new_code_segment(data, size);
+        swap_words(seg, bytes, size);
+
+        /* Add segment 0 to Data struct */
+        data->memory[0] = seg;
+        decode_segment_0(data);
+        data->code_hash = 0;
+        data->code_clean = true;
+}
+
+/* * * * * * * * * * * * * * * * * read_um_file * * * * * * * * * * * * * *
+*
+* Reads the bytes of a UM binary file.
+*
+* Parameters:
+*       FILE *fp:       open file pointer to UM binary
+*       size_t *length: set to the number of bytes read
+*       bool *mapped:   set to whether the bytes are memory-mapped
+*
+* Return: the bytes, to be unmapped (if mapped) or freed by the caller, or
+*         NULL if the file could not be read
+*
+* Expects:
+*      fp is not null
+*
+* Notes:
+*      Regular files are memory-mapped, so they are converted in one pass;
+*      anything else (such as a pipe) is read in blocks
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static uint8_t *read_um_file(FILE *fp, size_t *length, bool *mapped)
+{
+        struct stat st;
+        int fd = fileno(fp);
+
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+                void *bytes = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+                                   fd, 0);
+
+                if (bytes != MAP_FAILED) {
+                        madvise(bytes, st.st_size, MADV_SEQUENTIAL);
+                        *length = st.st_size;
+                        *mapped = true;
+                        return bytes;
+                }
+        }
+
+        /* Not mappable: read the whole stream */
+        size_t capacity = 4096;
+        uint8_t *bytes = malloc(capacity);
+        *length = 0;
+        *mapped = false;
+
+        size_t n;
+        while (bytes != NULL &&
+               (n = fread(bytes + *length, 1, capacity - *length, fp)) > 0) {
+                *length += n;
+                if (*length == capacity) {
+                        capacity *= 2;
+                        uint8_t *larger = realloc(bytes, capacity);
+                        if (larger == NULL) {
+                                free(bytes);
+                        }
+                        bytes = larger;
+                }
+        }
+
+        if (bytes != NULL && ferror(fp)) {
+                free(bytes);
+                bytes = NULL;
+        }
+        return bytes;
+}
+
+/* * * * * * * * * * * * * * * * * reserve_table * * * * * * * * * * * * * * *
+*
+* Reserves address space for a segment table array covering every
+* identifier, without committing memory for it.
+*
+* Parameters:
+*       size_t entry_size:      bytes in one entry of the array
+*
+* Return: the zero-filled array, or NULL if the reservation was refused
+*         (for instance by a ulimit -v or strict overcommit)
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static void *reserve_table(size_t entry_size)
+{
+        void *table = mmap(NULL, TABLE_ENTRIES * entry_size,
+                           PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+        return table == MAP_FAILED ? NULL : table;
+}
+
+/* * * * * * * * * * * * * * * * * new_data * * * * * * * * * * * * * * * * *
+*
+* Allocates a Data structure with an empty segment table, reserved for
+* every identifier if possible.
+*
+* Parameters:
+*      uint32_t capacity:      entries to allocate in the segment table if
+*                              it cannot be reserved
+*
+* Return: newly allocated Data object whose segment 0 is not yet set
+*
+* Notes:
+*       The data struct and its tables are freed later in data_free()
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static T new_data(uint32_t capacity)
+{
+        /* Segments are laid out by the page size */
+        pthread_once(&page_once, find_page_size);
+
+        /* Malloc and initialize components of the Data struct */
+        T data = malloc(sizeof(struct T));
+        assert(data != NULL);
+
+        data->memory = reserve_table(sizeof(uint32_t *));
+        data->table_reserved = data->memory != NULL;
+
+        if (data->table_reserved) {
+                data->capacity = TABLE_ENTRIES;
+        } else {
+                data->capacity = capacity;
+                data->memory = malloc(capacity * sizeof(uint32_t *));
+                assert(data->memory != NULL);
+        }
+
+        data->free_head = 0;
+        
+        for (int i = 0; i < 8; i++) {
+                data->registers[i] = 0;
+        }
+
+        data->decoded = NULL;
+        data->fused = false;
+        data->folds = NULL;
+        data->fold_count = 0;
+        data->fold_capacity = 0;
+        data->fold_free = NO_FOLD;
+        data->folded_runs = 0;
+        data->or_idioms = 0;
+        data->words_removed = 0;
+        data->watcher = NULL;
+        data->watcher_cl = NULL;
+        data->code_start = NULL;
+        data->code_end = NULL;
+        data->code_block = NULL;
+        data->code_block_bytes = 0;
+        data->code_spare = NULL;
+        data->code_spare_bytes = 0;
+        data->page_faults = NULL;
+        data->code_watched = true;
+        data->code_faults = 0;
+        data->code_hash = 0;
+        data->code_clean = false;
+        memset(data->code_cache, 0, sizeof(data->code_cache));
+        data->code_cache_bytes = 0;
+        data->code_cache_clock = 0;
+        data->code_hits = 0;
+        data->code_misses = 0;
+
+        for (int class = 0; class <= POOL_MAX_CLASS; class++) {
+                data->pool[class] = NULL;
+        }
+        data->pool_bytes = 0;
+        data->pool_hits = 0;
+        data->pool_misses = 0;
+        for (int class = 0; class < MAX_CLASS; class++) {
+                data->lazy[class] = NULL;
+        }
+        data->lazy_bytes = 0;
+        data->guard_page = 0;
+        data->huge_min = 0;
+        data->huge_segments = 0;
+
+        data->output_fd = STDOUT_FILENO;
+        data->output_batch = false;
+        data->output_lines = isatty(STDOUT_FILENO);
+        data->output_length = 0;
+        data->input_fd = STDIN_FILENO;
+        data->input_eof = false;
+        data->input_pos = 0;
+        data->input_length = 0;
+        data->reader = NULL;
+        data->writer = NULL;
+        data->io_cl = NULL;
+
+        data->snapshot_path = NULL;
+        data->restored = NULL;
+        data->restored_length = 0;
+
+        data->memory_index = 0;
+        data->size = 1;
+
+        return data;
+}
+
+/* * * * * * * * * * * * * * * * * initialize_data * * * * * * * * * * * * * *
+*
+* Initializes and returns a new Data structure.
+*
+* Parameters:
+*      FILE *fp:       file pointer to the binary input file
+*
+* Return: newly allocated and initialized Data object, or NULL if the file
+*         cannot be read or is not a whole number of words
+*
+* Expects:
+*      Expects fp to not be NULL
+*
+* Notes:
+*       The data struct is malloced as well as the sequence for memory 
+*       both are freed later in data_free(). Nothing is printed on
+*       failure; the caller reports it.
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+T initialize_data(FILE *fp) 
+{
+        // assert(fp != NULL);
+
+        size_t length;
+        bool mapped;
+        uint8_t *bytes = read_um_file(fp, &length, &mapped);
+        if (bytes == NULL) {
+                return NULL;
+        }
+
+        /* Place input file contents in segment 0 */
+        T data = initialize_data_bytes(bytes, length);
+
+        if (mapped) {
+                munmap(bytes, length);
+        } else {
+                free(bytes);
+        }
+        return data;
+}
+
+/* * * * * * * * * * * * * * * * initialize_data_bytes * * * * * * * * * * * *
+*
+* Initializes the UM data structure with a program already in memory.
+*
+* Parameters:
+*      const uint8_t *bytes:    the program, in .um file format
+*      size_t length:           bytes in the program
+*
+* Return: newly allocated Data object with the program in segment 0, or
+*         NULL if length is not a multiple of 4
+*
+* Expects:
+*      bytes is not null unless length is 0
+*
+* Notes:
+*      bytes is only read here; the caller keeps ownership of it
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+T initialize_data_bytes(const uint8_t *bytes, size_t length)
+{
+        /* An incomplete .um file is rejected before anything is made */
+        if (length % 4 != 0) {
+                return NULL;
+        }
+
+        T data = new_data(10);
+        load_program_bytes(data, bytes, length);
+        return data;
+}
+
+/* * * * * * * * * * * * * * * * get_program_counter * * * * * * * * * * * *
+*
+* Returns the index in segment 0 where execution starts or resumes
+*
+* Parameters:
+*      T data:               UM data structure
+*
+* Return: memory_index, the saved program counter
+*
+* Expects:
+*      Expects T data to not be null
+*
+* Notes:
+*      This is 0 for a freshly loaded program and the interrupted input
+*      instruction for a restored snapshot
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+uint32_t get_program_counter(T data)
+{
+        return data->memory_index;
+}
+
+/* * * * * * * * * * * * * * * * set_program_counter * * * * * * * * * * * *
+*
+* Records the program counter of a dispatcher that keeps its own copy
+*
+* Parameters:
+*      T data:               UM data structure
+*      uint32_t pc:          index in segment 0 of the current instruction
+*
+* Return: nothing
+*
+* Expects:
+*      Expects T data to not be null
+*
+* Notes:
+*      Dispatchers call this before get_input, so a snapshot taken there
+*      resumes at the input instruction
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void set_program_counter(T data, uint32_t pc)
+{
+        data->memory_index = pc;
+}
+
+/* * * * * * * * * * * * * * * * * extract_word * * * * * * * * * * * * * * * *
+*
+* Returns the word at memory_index in the current segment 0 and increment
+* memory_index
+*
+* Parameters:
+*      T data:               UM data structure
+*
+* Return: the word at the specified location
+*
+* Expects:
+*      Expects T data to not be null
+*
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+uint32_t extract_word(T data)
+{
+        // assert(data != NULL);
+        
+        /* Grab the word at (segment 0, memory_index) */
+        // Seq_T seg = Seq_get(data->memory, 0);
+        // uint32_t val =  (uint32_t)(uintptr_t) Seq_get(seg, data->memory_index);
+
+
+        data->memory_index++;
+        
+        return data->memory[0][data->memory_index - 1];
+}
+
+/* * * * * * * * * * * * * * * * * segment_zero * * * * * * * * * * * * * * *
 *
-* a struct containing all relevant information pertaining to the Universal
-* Machine data
-*/
-struct T {
-        uint32_t **memory; /* Sequence that holds all data segments */
-        Seq_T unmaps; /* Sequence that holds all unmapped indexes */
-        uint32_t *seg_sizes;
-        // uint32_t registers[8]; /* Array that holds all 8 registers */
-        int memory_index; /* Tracks the current word index in segment 0 */
-        int size;
-        int capacity;
-};
+* Returns the words of the current segment 0 so a dispatcher can fetch
+* instructions without a call per word
+*
+* Parameters:
+*      T data:               UM data structure
+*
+* Return: pointer to the first word of segment 0
+*
+* Expects:
+*      Expects T data to not be null
+*
+* Notes:
+*      The pointer is invalidated by replace_segment_0, so callers must fetch
+*      it again after every load_program
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+uint32_t *segment_zero(T data)
+{
+        return data->memory[0];
+}
 
-/* * * * * * * * * * * * * * * * * read_um_file * * * * * * * * * * * * * *
+/* * * * * * * * * * * * * * * * decoded_segment_zero * * * * * * * * * * * *
 *
-* Reads a UM binary file into segment 0.
+* Returns segment 0 in pre-decoded form, one Instruction per word
 *
 * Parameters:
-*       T data:         initialized Data structure
-*       FILE *fp:       open file pointer to UM binary
+*      T data:               UM data structure
 *
-* Return: nothing
+* Return: pointer to the decoded first word of segment 0
 *
 * Expects:
-*      T data is not null and fp is not null
+*      Expects T data to not be null
 *
 * Notes:
-*      Seg allocation is freed later in data_free
+*      Entries of a page stored to are left stale (STALE_OPCODE) until
+*      refresh_code, and the array itself is replaced by replace_segment_0
+*      and must be fetched again afterwards
 * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
-static void read_um_file(T data, FILE *fp)
+Instruction *decoded_segment_zero(T data)
 {
-        /* Create a sequence of segmented memory */
-        // Seq_T seg = Seq_new(0);
-        int size = 0;
-        int capacity = 100;
-        uint32_t *seg = malloc(capacity * sizeof(uint32_t));
-        assert(seg != NULL);
-        
-        /*
-         * Grabs each 32 bit word places them into
-         * the corresponding position in the seg sequence
-        */
-        int byte = 0;
-        uint32_t val = 0;
-        while ((byte = fgetc(fp)) != EOF) {
-                for (int i = 0; i < 3; i++) {
-                        /* If .um file is incomplete, EXIT_FAILURE */
-                        if(byte == EOF) {
-                                fprintf(stderr, "Invalid .um file");
-                                exit(EXIT_FAILURE);
-                        }
-                        val = (val << 8) | (uint32_t) byte;
-                        byte = fgetc(fp);
+        return data->decoded;
+}
+
+/* * * * * * * * * * * * * * * * * set_fusion * * * * * * * * * * * * * * * *
+*
+* Turns superinstructions on or off in the decoded copy of segment 0. With
+* fusion on, an entry followed by one it is commonly paired with (see
+* enum Fused_opcode) gets a fused opcode, and the pair then runs as one
+* dispatch of run_um. Constant runs and OR idioms are fused as well (see
+* FOLD_MAX).
+*
+* Parameters:
+*      T data:       UM data structure
+*      bool on:      whether decoded_segment_zero should hold fused opcodes
+*
+* Return: Nothing
+*
+* Expects:
+*      Expects T data to not be null
+*
+* Notes:
+*      The setting lasts across load_program and is kept up to date by
+*      refresh_code. Entries are changed in place, so pointers from
+*      decoded_segment_zero stay valid, and stale entries stay stale. Only
+*      run_um understands the fused opcodes, and each interpreter loop sets
+*      the form it needs on entry.
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void set_fusion(T data, bool on)
+{
+        assert(data != NULL);
+
+        if (data->fused == on) {
+                return;
+        }
+        data->fused = on;
+
+        uint32_t *seg = data->memory[0];
+        uint32_t size = LENGTH(seg);
+        if (on) {
+                fuse_segment_0(data);
+                return;
+        }
+        for (uint32_t i = 0; i < size; i++) {
+                if (data->decoded[i].opcode != STALE_OPCODE) {
+                        data->decoded[i].opcode = seg[i] >> 28;
                 }
-                /* bit shift val to input big endian order */
-                val = (val << 8) | (uint32_t) byte;
+        }
+}
 
-                if (size >= capacity) {
-                        capacity *= 2;
-                        seg = realloc(seg, capacity * sizeof(uint32_t));
+/* * * * * * * * * * * * * * * * * folded_constants * * * * * * * * * * * * *
+*
+* Returns the constant runs that FUSED_CONSTANTS entries of segment 0 refer
+* to, by the index in their value.
+*
+* Parameters:
+*      T data:       UM data structure
+*
+* Return: the array of folded runs
+*
+* Expects:
+*      Expects T data to not be null
+*
+* Notes:
+*      The array may move whenever entries are fused, so it must be fetched
+*      again after set_fusion, refresh_code and load_program
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+Fold *folded_constants(T data)
+{
+        assert(data != NULL);
+        return data->folds;
+}
+
+/* * * * * * * * * * * * * * * * * refresh_code * * * * * * * * * * * * * * *
+*
+* Decodes the page of segment 0 holding a word again, after stores to it
+* left its entries stale, and write-protects the page again. If the page
+* is one the program keeps storing to (see VOLATILE_FAULTS), it is left
+* writable and segment 0 is WATCHED instead.
+*
+* Parameters:
+*      T data:                  UM data structure
+*      uint32_t word_index:     a stale entry of segment 0
+*
+* Return: the word decoded afresh, unfused, to be run in place of the entry
+*
+* Expects:
+*      Expects T data to not be null and word_index to be in segment 0
+*
+* Notes:
+*      The entry before the page is refused with the page's first word, so
+*      a fused pair may span the two, unless it is stale itself; its own
+*      page is then refreshed when it is reached. Entries are changed in
+*      place, so pointers from decoded_segment_zero stay valid.
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+Instruction refresh_code(T data, uint32_t word_index)
+{
+        uint32_t *seg = data->memory[0];
+        uintptr_t page = (uintptr_t) (seg + word_index) & ~(page_size - 1);
+        uint32_t first, end;
+        Instruction fresh;
+
+        decode_word(&fresh, seg[word_index]);
+        page_words(seg, page, &first, &end);
+        for (uint32_t i = first; i < end; i++) {
+                release_fold(data, i);
+                decode_word(&data->decoded[i], seg[i]);
+        }
+        if (data->fused) {
+                for (uint32_t i = first; i < end; i++) {
+                        fuse_word(data, i);
+                        i += fused_length(data, i) - 1;
                 }
+                if (first > 0 &&
+                    data->decoded[first - 1].opcode != STALE_OPCODE) {
+                        fuse_word(data, first - 1);
+                }
+        }
 
-                seg[size] = val;
-                size++;
-                // Seq_addhi(seg, (void *)(uintptr_t) val);
+        if (watched_word(data, word_index)) {
+                REFS(seg) |= WATCHED;
+        } else {
+                mprotect((void *) page, page_size, PROT_READ);
         }
+        return fresh;
+}
 
-        /* Add segment 0 to Data struct */
-        // Seq_addhi(data->memory, seg); 
-        data->memory[0] = seg; 
-        data->seg_sizes[0] = size;
+/* * * * * * * * * * * * * * * * use_write_barrier * * * * * * * * * * * * *
+*
+* Catches stores into segment 0 with the write barrier from now on, in
+* place of sending every store to a WATCHED segment 0 down the slow path.
+* The process's SIGSEGV handler is installed the first time, so only a
+* host that asks for the barrier gets it.
+*
+* Parameters:
+*      T data:       UM data structure
+*
+* Return: Nothing
+*
+* Expects:
+*      Expects T data to not be null
+*
+* Notes:
+*      Segment 0 may move to pages of its own, but its decoded entries are
+*      kept. Constant runs and ORs are only fused under the barrier, so a
+*      fused segment 0 is fused again. Once guard_segments is called the
+*      barrier stays off (see there).
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void use_write_barrier(T data)
+{
+        assert(data != NULL);
+
+        pthread_once(&barrier_once, start_barrier);
+        if (!data->code_watched || data->guard_page != 0) {
+                return;
+        }
+
+        unprotect_code(data);
+        data->code_watched = false;
+        protect_code(data);
+        if (data->fused) {
+                fuse_segment_0(data);
+        }
 }
 
-/* * * * * * * * * * * * * * * * * initialize_data * * * * * * * * * * * * * *
+/* * * * * * * * * * * * * * * * * attach_thread * * * * * * * * * * * * * * *
 *
-* Initializes and returns a new Data structure.
+* Makes a machine the one whose stores into segment 0 are caught on the
+* calling thread.
 *
 * Parameters:
-*      FILE *fp:       file pointer to the binary input file
+*      T data:       UM data structure about to run
 *
-* Return: newly allocated and initialized Data object
+* Return: Nothing
 *
 * Expects:
-*      Expects fp to not be NULL
+*      Expects T data to not be null
 *
 * Notes:
-*       The data struct is malloced as well as the sequence for memory 
-*       both are freed later in data_free()
+*      Every interpreter loop and the JIT call this on entry, as a machine
+*      may run on a thread other than the one that loaded it
 * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
-T initialize_data(FILE *fp) 
+void attach_thread(T data)
 {
-        // assert(fp != NULL);
+        barrier_machine = data;
+}
 
-        /* Malloc and initialize components of the Data struct */
-        T data = malloc(sizeof(struct T));
-        assert(data != NULL);
+/* * * * * * * * * * * * * * * * code_write_fault * * * * * * * * * * * * * *
+*
+* Handles a fault at an address if it is a store into the write-protected
+* segment 0 of the machine attached to this thread: marks the entries of
+* the page stale, tells the watcher about each word, and unprotects it.
+*
+* Parameters:
+*      const void *address:     the address that was accessed
+*
+* Return: true if the fault was handled and the store can be retried,
+*         false if it is some other fault
+*
+* Notes:
+*      Called from SIGSEGV handlers, so it only touches the machine's own
+*      arrays. With fusion on, the entry before the page goes stale too,
+*      since it may be fused with the page's first word.
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+bool code_write_fault(const void *address)
+{
+        T data = barrier_machine;
+        uint8_t *at = (uint8_t *) address;
 
-        data->memory = malloc(10 * sizeof(uint32_t*));
-        assert(data->memory != NULL);
+        if (data == NULL || at < data->code_start || at >= data->code_end) {
+                return false;
+        }
 
-        data->unmaps = Seq_new(0);
-        // assert(data->unmaps != NULL);
+        uint32_t *seg = data->memory[0];
+        uintptr_t page = (uintptr_t) at & ~(page_size - 1);
+        uint32_t first, end;
 
-        data->seg_sizes = malloc(10 * sizeof(int));
-        assert(data->seg_sizes != NULL);
-        
-        // for (int i = 0; i < 8; i++) {
-        //         data->registers[i] = 0;
-        // }
+        page_words(seg, page, &first, &end);
+        if (data->fused && first > 0) {
+                data->decoded[first - 1].opcode = STALE_OPCODE;
+        }
+        for (uint32_t i = first; i < end; i++) {
+                data->decoded[i].opcode = STALE_OPCODE;
+                if (data->watcher != NULL) {
+                        data->watcher(data->watcher_cl, i);
+                }
+        }
 
-        data->memory_index = 0;
-        data->size = 1;
-        data->capacity = 10;
+        uint8_t *faults = &data->page_faults[(page - (uintptr_t)
+                                              data->code_start) / page_size];
+        if (*faults < VOLATILE_FAULTS) {
+                (*faults)++;
+        }
+        data->code_faults++;
+        data->code_clean = false;
+        mprotect((void *) page, page_size, PROT_READ | PROT_WRITE);
+        return true;
+}
 
-        /* Place input file contents in segment 0 */
-        read_um_file(data, fp);
+/* * * * * * * * * * * * * * * * * guard_segments * * * * * * * * * * * * * *
+*
+* Puts every segment of GUARD_MIN_WORDS words or more, from now on and
+* those already mapped, right in front of a PROT_NONE guard page. A load
+* or store past the end of such a segment then raises SIGSEGV, which
+* segment_at_address can trace back to the segment.
+*
+* Parameters:
+*      T data:       UM data structure
+*
+* Return: Nothing
+*
+* Expects:
+*      Expects T data to not be null, and to be called at most once
+*
+* Notes:
+*      Segments already mapped are moved to guarded copies, which ends any
+*      sharing between them; load_program shares afresh from then on.
+*      get_word and set_word are unchanged, so there is no cost per access.
+*      Segment 0 is guarded like the rest rather than kept on code pages,
+*      so its stores are watched from then on in place of the barrier.
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void guard_segments(T data)
+{
+        assert(data != NULL && data->guard_page == 0);
 
-        return data;
+        size_t page = sysconf(_SC_PAGESIZE);
+
+        /* The originals go back to the pool, so guarding starts after */
+        unprotect_code(data);
+        flush_code_cache(data);
+        for (uint32_t i = 0; i < data->size; i++) {
+                uint32_t *seg = data->memory[i];
+                if (IS_FREE(seg) || LENGTH(seg) < GUARD_MIN_WORDS) {
+                        continue;
+                }
+
+                uint32_t *copy = new_guarded_segment(data, LENGTH(seg), page);
+                memcpy(copy, seg, LENGTH(seg) * sizeof(uint32_t));
+                release_segment(data, seg);
+                data->memory[i] = copy;
+        }
+
+        /* A code mapping has no guard page, so segment 0 must not move */
+        data->guard_page = page;
+        data->code_watched = true;
+        decode_segment_0(data);
 }
 
-/* * * * * * * * * * * * * * * * * extract_word * * * * * * * * * * * * * * * *
+/* * * * * * * * * * * * * * * * * set_huge_pages * * * * * * * * * * * * * *
 *
-* Returns the word at memory_index in the current segment 0 and increment
-* memory_index
+* Puts every segment of at least min_words words, from now on and those
+* already mapped, on transparent huge pages.
 *
 * Parameters:
 *      T data:               UM data structure
+*      uint32_t min_words:   smallest segment to put on huge pages
 *
-* Return: the word at the specified location
+* Return: Nothing
 *
 * Expects:
-*      Expects T data to not be null
+*      Expects T data to not be null and min_words to be positive, and to
+*      be called at most once, before guard_segments
 *
+* Notes:
+*      A segment smaller than a huge page still takes a whole one of
+*      address space (and of memory, once the kernel backs it), so
+*      min_words is best kept near 2 MB worth of words
 * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
-uint32_t extract_word(T data)
+void set_huge_pages(T data, uint32_t min_words)
 {
-        // assert(data != NULL);
-        
-        /* Grab the word at (segment 0, memory_index) */
-        // Seq_T seg = Seq_get(data->memory, 0);
-        // uint32_t val =  (uint32_t)(uintptr_t) Seq_get(seg, data->memory_index);
+        assert(data != NULL && min_words > 0);
+        assert(data->huge_min == 0 && data->guard_page == 0);
+
+        /* The originals go back to the pool, so the policy starts after */
+        unprotect_code(data);
+        flush_code_cache(data);
+        for (uint32_t i = 0; i < data->size; i++) {
+                uint32_t *seg = data->memory[i];
+                if (IS_FREE(seg) || LENGTH(seg) < min_words) {
+                        continue;
+                }
 
+                uint32_t *copy = new_huge_segment(data, LENGTH(seg));
+                memcpy(copy, seg, LENGTH(seg) * sizeof(uint32_t));
+                release_segment(data, seg);
+                data->memory[i] = copy;
+        }
 
-        data->memory_index++;
-        
-        return data->memory[0][data->memory_index - 1];
+        data->huge_min = min_words;
+        protect_code(data);
+}
+
+/* * * * * * * * * * * * * * * * * huge_page_bytes * * * * * * * * * * * * * *
+*
+* Returns how much of the memory advised for huge pages the kernel has
+* actually backed with them, from /proc/self/smaps.
+*
+* Parameters: none
+*
+* Return: the bytes on huge pages, or 0 if smaps cannot be read
+*
+* Notes:
+*      Counts every mapping in the process with the hg (MADV_HUGEPAGE)
+*      flag, which are the huge segments of all machines
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static uint64_t huge_page_bytes(void)
+{
+        FILE *fp = fopen("/proc/self/smaps", "r");
+        if (fp == NULL) {
+                return 0;
+        }
+
+        char line[256];
+        unsigned long long kb, mapping_kb = 0;
+        uint64_t total = 0;
+
+        /* AnonHugePages comes before VmFlags, the last line of a mapping */
+        while (fgets(line, sizeof(line), fp) != NULL) {
+                if (sscanf(line, "AnonHugePages: %llu kB", &kb) == 1) {
+                        mapping_kb = kb;
+                } else if (strncmp(line, "VmFlags:", 8) == 0) {
+                        if (strstr(line, " hg") != NULL) {
+                                total += (uint64_t) mapping_kb << 10;
+                        }
+                        mapping_kb = 0;
+                }
+        }
+
+        fclose(fp);
+        return total;
+}
+
+/* * * * * * * * * * * * * * * * segment_at_address * * * * * * * * * * * * *
+*
+* Finds the guarded segment whose guard page (or words) hold an address,
+* for reporting a fault.
+*
+* Parameters:
+*      T data:                   UM data structure
+*      const void *address:      the address that was accessed
+*      uint32_t *segment_index:  set to the segment's identifier
+*      int64_t *word_index:      set to the index of the word accessed
+*
+* Return: true if a segment was found, false otherwise (such as for an
+*         access through an unmapped identifier or a wild index)
+*
+* Notes:
+*      Only reads the segment table, so it may be called from a signal
+*      handler. guard_segments must have been called.
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+bool segment_at_address(T data, const void *address, uint32_t *segment_index,
+                        int64_t *word_index)
+{
+        uintptr_t at = (uintptr_t) address;
+
+        for (uint32_t i = 0; i < data->size; i++) {
+                uint32_t *seg = data->memory[i];
+                if (IS_FREE(seg) || LENGTH(seg) < GUARD_MIN_WORDS) {
+                        continue;
+                }
+
+                uintptr_t start = (uintptr_t) seg;
+                uintptr_t end = (uintptr_t) (seg + LENGTH(seg));
+                if (at >= start && at < end + data->guard_page) {
+                        *segment_index = i;
+                        *word_index = (at - start) / sizeof(uint32_t);
+                        return true;
+                }
+        }
+        return false;
+}
+
+/* * * * * * * * * * * * * * * * watch_segment_0 * * * * * * * * * * * * * *
+*
+* Registers a function to be told about every change to segment 0, so
+* anything built from the program (such as compiled code) can be discarded
+*
+* Parameters:
+*      T data:               UM data structure
+*      Code_watcher watcher: function to call, or NULL to stop watching
+*      void *cl:             closure passed back to watcher
+*
+* Return: nothing
+*
+* Expects:
+*      Expects T data to not be null
+*
+* Notes:
+*      Only one watcher is kept; registering another replaces it
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void watch_segment_0(T data, Code_watcher watcher, void *cl)
+{
+        data->watcher = watcher;
+        data->watcher_cl = cl;
+}
+
+/* * * * * * * * * * * * * * * * * segment_length * * * * * * * * * * * * * *
+*
+* Returns the number of words in a mapped segment
+*
+* Parameters:
+*      T data:               UM data structure
+*      int segment_index:    index in the data->memory array
+*
+* Return: the length of the segment in words
+*
+* Expects:
+*      Expects T data to not be null and segment_index to be mapped
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+uint32_t segment_length(T data, int segment_index)
+{
+        return LENGTH(data->memory[segment_index]);
 }
 
 /* * * * * * * * * * * * * * * * * get_word * * * * * * * * * * * * * * * *
@@ -198,7 +2470,57 @@ uint32_t get_word(T data, int segment_index, int word_index) {
         
         // uint32_t val = (uint32_t)(uintptr_t) Seq_get(seg, word_index); 
 
-        return data->memory[segment_index][word_index];
+        return data->memory[segment_index][word_index];
+}
+
+/* * * * * * * * * * * * * * * * * store_slowly * * * * * * * * * * * * * * *
+*
+* The slow path of set_word, for a segment that is shared or WATCHED.
+*
+* Parameters:
+*      T data:               UM data structure
+*      int segment_index:    index in the data->memory array
+*      int word_index:       index in the segment array
+*      uint32_t word:        word to store
+*
+* Return: Nothing
+*
+* Notes:
+*      A shared segment is copied first. A store into a watched word of a
+*      WATCHED segment 0 is passed to the watcher and decoded at once,
+*      refusing the entry before it as well unless that one is stale. A
+*      store to any other word of it faults, as on the fast path.
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static void store_slowly(T data, int segment_index, int word_index,
+                         uint32_t word)
+{
+        uint32_t *seg = data->memory[segment_index];
+
+        if ((REFS(seg) & ~WATCHED) != 1) {
+                seg = unshare_segment(data, segment_index);
+        }
+        seg[word_index] = word;
+        if (segment_index == 0) {
+                /* It can no longer be cached as the program it was */
+                data->code_clean = false;
+        }
+
+        if (segment_index == 0 && (REFS(seg) & WATCHED) != 0 &&
+            watched_word(data, word_index)) {
+                if (data->watcher != NULL) {
+                        data->watcher(data->watcher_cl, word_index);
+                }
+                release_fold(data, word_index);
+                decode_word(&data->decoded[word_index], word);
+                if (data->fused) {
+                        if (word_index > 0 &&
+                            data->decoded[word_index - 1].opcode !=
+                            STALE_OPCODE) {
+                                fuse_word(data, word_index - 1);
+                        }
+                        fuse_word(data, word_index);
+                }
+        }
 }
 
 void set_word(T data, int segment_index, int word_index, uint32_t word)
@@ -208,7 +2530,16 @@ void set_word(T data, int segment_index, int word_index, uint32_t word)
         
         // Seq_put(seg, word_index, (void *)(uintptr_t) word);
 
-        data->memory[segment_index][word_index] = word;
+        uint32_t *seg = data->memory[segment_index];
+
+        /* Shared segments and a WATCHED segment 0 take the slow path */
+        if (REFS(seg) != 1) {
+                store_slowly(data, segment_index, word_index, word);
+                return;
+        }
+
+        /* Segment 0 is otherwise write-protected: see code_write_fault */
+        seg[word_index] = word;
 }
 
 
@@ -230,14 +2561,10 @@ void set_word(T data, int segment_index, int word_index, uint32_t word)
 * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 uint32_t get_register(T data, int register_num) 
 {
-        // assert(data != NULL);
-        // assert(register_num >= 0 && register_num < 8);
-
-        // return data->registers[register_num];
+        assert(data != NULL);
+        assert(register_num >= 0 && register_num < 8);
 
-        (void) data; 
-        (void) register_num;
-        return 1;
+        return data->registers[register_num];
 }
 
 /* * * * * * * * * * * * * * * * * set_register * * * * * * * * * * * * * * * *
@@ -259,14 +2586,55 @@ uint32_t get_register(T data, int register_num)
 * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 void set_register(T data, int register_num, uint32_t value) 
 {
-        // assert(data != NULL);
-        // assert(register_num >= 0 && register_num < 8);
+        assert(data != NULL);
+        assert(register_num >= 0 && register_num < 8);
+
+        data->registers[register_num] = value;
+}
 
-        // data->registers[register_num] = value;
+/* * * * * * * * * * * * * * * * data_registers * * * * * * * * * * * * * * *
+*
+* Returns the machine's register file, for the execution loops that read
+* and write registers on every instruction
+*
+* Parameters:
+*      T data:               UM data structure
+*
+* Return: pointer to the eight registers, valid until data_free
+*
+* Expects:
+*      Expects T data to not be null
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+uint32_t *data_registers(T data)
+{
+        assert(data != NULL);
+        return data->registers;
+}
 
-        (void) data;
-        (void) register_num;
-        (void) value;
+/* * * * * * * * * * * * * * * * segment_table * * * * * * * * * * * * * * *
+*
+* Returns where the machine keeps its segment table, for generated code
+* that loads and stores words without calling get_word and set_word
+*
+* Parameters:
+*      T data:               UM data structure
+*
+* Return: pointer to the table pointer, valid until data_free. Word w of
+*         segment s is (*table)[s][w], and (*table)[s][-1] is the count of
+*         references to segment s.
+*
+* Expects:
+*      Expects T data to not be null
+*
+* Notes:
+*      The table may move as it grows, so it is read through this pointer
+*      every time. A store may only go straight to the segment when its
+*      count is 1; any other goes through set_word.
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+uint32_t ***segment_table(T data)
+{
+        assert(data != NULL);
+        return &data->memory;
 }
 
 
@@ -286,20 +2654,29 @@ void set_register(T data, int register_num, uint32_t value)
 *      0 and less than data->size,
 *
 * Notes:
+*      The segment's buffer goes back to the pool right away and its table
+*      entry becomes the head of the free list, which is threaded through
+*      the table itself. Identifiers are reused last-unmapped-first, so the slot
+*      handed out next is the one most likely to still be in cache.
 *      Failure to meet these expectations results in a CRE
 * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 void set_segment_false(T data, int segment_index) {
         // assert(data != NULL);
         // assert(segment_index >= 0 && segment_index < data->size);
 
-        /* Unmap segment by adding segment_index to unmaps sequence */
-        Seq_addhi(data->unmaps, (void *)(uintptr_t) segment_index);
+        release_segment(data, data->memory[segment_index]);
+
+        /* Unmap segment by pushing segment_index onto the free list */
+        data->memory[segment_index] = FREE_ENTRY(data->free_head);
+        data->free_head = segment_index;
 }
 
 /* * * * * * * * * * * * * * * * replace_segment_0 * * * * * * * * * * * * * * *
 *
-* Replaces segment 0 with a duplicate of a specified segment in a given memory
-* index
+* Replaces segment 0 with a copy-on-write share of a specified segment and
+* sets the program counter to a given memory index. The program replaced
+* goes into the code cache, and one with the same words is taken back out
+* of it instead of being shared and decoded again.
 *
 * Parameters:
 *      T data: UM data structure
@@ -329,41 +2706,32 @@ void replace_segment_0(T data, int segment_index, int memory_index)
                 return;
         }
 
-        /* Discard the old segment 0 */
-        // Seq_T seg_0 = Seq_get(data->memory, 0);
-
-        // Seq_free(&seg_0);
-
-        free(data->memory[0]);
-
-        /* Grab the segment that will be loaded into segment 0 */
-        // Seq_T seg = Seq_get(data->memory, segment_index);
-        
-        // int size = Seq_length(seg);
+        if (data->watcher != NULL) {
+                data->watcher(data->watcher_cl, -1);
+        }
 
+        /*
+         * Share the loaded segment with segment 0 instead of copying it;
+         * set_word makes the copy if either side is stored to later. The
+         * new reference is taken first in case the two are already shared.
+         */
         uint32_t *seg = data->memory[segment_index];
 
-        // int size = data->size;
-
-        int size = data->seg_sizes[segment_index];
-
-        /* Create a deep copy of the segment and place in segment 0 */
-        // Seq_T seg_new = Seq_new(0);
-
-        uint32_t *seg_new = malloc(size * sizeof(uint32_t)); 
-        assert(seg_new != NULL);
-        for (int i = 0; i < size; i++) {
-                // uint32_t val = (uint32_t)(uintptr_t) Seq_get(seg, i);
-
-                
-                // Seq_addhi(seg_new, (void *)(uintptr_t) val);
-
-                seg_new[i] = seg[i];
+        unprotect_code(data);
+        REFS(seg)++;
+        if (!cache_segment_0(data)) {
+                release_segment(data, data->memory[0]);
         }
 
-        // Seq_put(data->memory, 0, seg_new);
-        data->memory[0] = seg_new;
-        data->seg_sizes[0] = size;
+        /* The same words were run before: take them back decoded */
+        if (take_cached_code(data, seg)) {
+                release_segment(data, seg);
+                protect_code(data);
+        } else {
+                data->memory[0] = seg;
+                decode_segment_0(data);
+        }
+        data->code_clean = true;
 }
 
 /* * * * * * * * * * * * * * * * * push_segment * * * * * * * * * * * * * * * *
@@ -380,31 +2748,26 @@ void replace_segment_0(T data, int segment_index, int memory_index)
 *      Expects T data to not be null
 *
 * Notes:
-*      Reallocs the memory and mapped arrays which will be freed in data_free
+*      A reserved segment table is never full. Otherwise the table is
+*      doubled with realloc when it is, and freed in data_free.
 * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 static int push_segment(T data, int size) 
 {
         /* Initialize a new sequence to the specified size */
         // Seq_T seg = Seq_new(0);
-        uint32_t *seg = malloc(size * sizeof(uint32_t));
-        assert(seg != NULL);
-        for (int i = 0; i < size; i++) {
-                // uint32_t val = 0;
-                // Seq_addhi(seg, (void *)(uintptr_t) val);
-                seg[i] = 0;
-        }
+        uint32_t *seg = new_zeroed_segment(data, size);
 
         if (data->size >= data->capacity) {
+                assert(!data->table_reserved);
                 data->capacity *= 2;
                 data->memory = realloc(data->memory, data->capacity * sizeof(uint32_t*));
-                data->seg_sizes = realloc(data->seg_sizes, data->capacity * sizeof(int));
+                assert(data->memory != NULL);
         }
 
         /* Add it to the Data struct and return its index */
         //Seq_addhi(data->memory, seg);
         //return Seq_length(data->memory) - 1;
         data->memory[data->size] = seg;
-        data->seg_sizes[data->size] = size;
 
         data->size++;
         return data->size - 1;
@@ -426,42 +2789,491 @@ static int push_segment(T data, int size)
 *
 * Notes:
 *      May malloc a new segment that will be freed in data_free() or
-*      within a seperate call of this function
+*      returned to the pool when it is unmapped
 * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 int insert_segment(T data, int size)
 {
         /* If there are no unmapped segments, push the segment */
-        int length = Seq_length(data->unmaps);
-        if (length == 0) {
+        if (data->free_head == 0) {
                 return push_segment(data, size);
         }
 
-        uint32_t index = (uint32_t)(uintptr_t) Seq_remlo(data->unmaps);
-
-        /* Discard the existing contents in the unmapped segment  */
-        // Seq_T seg = Seq_get(data->memory, index);
-        // Seq_free(&seg);
-
-        free(data->memory[index]);
+        /* Pop the most recently unmapped identifier off the free list */
+        uint32_t index = data->free_head;
+        data->free_head = NEXT_FREE(data->memory[index]);
 
         /* Initialize a new segment to the specified size */
         // seg = Seq_new(0);
-        uint32_t *seg = malloc(size * sizeof(uint32_t));
-        assert(seg != NULL);
-        for (int i = 0; i < size; i++) {
-                // uint32_t val = 0;
-                // Seq_addhi(seg, (void *)(uintptr_t) val);
-
-                seg[i] = 0;
-        }
+        uint32_t *seg = new_zeroed_segment(data, size);
 
         /* Place the segment in the Data struct and return its index */
         // Seq_put(data->memory, index, seg);
         data->memory[index] = seg;
-        data->seg_sizes[index] = size;
         return index;
 }
 
+/* * * * * * * * * * * * * * * * * save_snapshot * * * * * * * * * * * * * *
+*
+* Writes the whole machine to the file requested by snapshot_at_input:
+* registers, memory_index, every segment with its length, and the free list
+* of unmapped identifiers.
+*
+* Parameters:
+*      T data:          UM data structure with a snapshot pending
+*
+* Return: Nothing
+*
+* Expects:
+*      Expects T data to not be null and memory_index to hold the pc of the
+*      input instruction being executed
+*
+* Notes:
+*      A segment shared by segment 0 and its load_program source is written
+*      once. Failure to write the file is reported on stderr and the
+*      program carries on.
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static void save_snapshot(T data)
+{
+        FILE *fp = fopen(data->snapshot_path, "wb");
+        if (fp == NULL) {
+                fprintf(stderr, "Could not write snapshot %s\n",
+                        data->snapshot_path);
+                return;
+        }
+
+        struct Snapshot_header header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+        memcpy(header.registers, data->registers, sizeof(header.registers));
+        header.memory_index = data->memory_index;
+        header.size = data->size;
+        header.free_head = data->free_head;
+
+        /* Lay out the segments after the table */
+        struct Snapshot_entry *entries = calloc(data->size, sizeof(*entries));
+        assert(entries != NULL);
+        uint64_t offset = sizeof(header) + data->size * sizeof(*entries);
+
+        for (uint32_t i = 0; i < data->size; i++) {
+                uint32_t *seg = data->memory[i];
+
+                if (IS_FREE(seg)) {
+                        entries[i].length = NEXT_FREE(seg);
+                        continue;
+                }
+                entries[i].length = LENGTH(seg);
+
+                /* Only load_program shares segments, and only a few */
+                if (REFS(seg) > 1) {
+                        uint32_t j;
+                        for (j = 0; j < i && data->memory[j] != seg; j++) {
+                        }
+                        if (j < i) {
+                                entries[i].offset = entries[j].offset;
+                                continue;
+                        }
+                }
+
+                offset = (offset + SNAPSHOT_ALIGN - 1) & ~(uint64_t)
+                         (SNAPSHOT_ALIGN - 1);
+                entries[i].offset = offset;
+                offset += ((uint64_t) entries[i].length + HEADER_WORDS) *
+                          sizeof(uint32_t);
+        }
+
+        bool ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+                  fwrite(entries, sizeof(*entries), data->size, fp) ==
+                  (size_t) data->size;
+
+        uint64_t written = sizeof(header) + data->size * sizeof(*entries);
+        for (uint32_t i = 0; i < data->size && ok; i++) {
+                if (entries[i].offset < written) {
+                        continue;       /* Unmapped, or shared and written */
+                }
+
+                static const uint8_t zeros[SNAPSHOT_ALIGN];
+                ok = fwrite(zeros, 1, entries[i].offset - written, fp) ==
+                     entries[i].offset - written;
+
+                size_t words = (size_t) entries[i].length + HEADER_WORDS;
+                ok = ok && fwrite(data->memory[i] - HEADER_WORDS,
+                                  sizeof(uint32_t), words, fp) == words;
+                written = entries[i].offset + words * sizeof(uint32_t);
+        }
+
+        if (fclose(fp) != 0 || !ok) {
+                fprintf(stderr, "Could not write snapshot %s\n",
+                        data->snapshot_path);
+        }
+        free(entries);
+}
+
+/* * * * * * * * * * * * * * * * snapshot_at_input * * * * * * * * * * * * * *
+*
+* Asks for the machine to be written to a snapshot file the first time the
+* program blocks waiting for input.
+*
+* Parameters:
+*      T data:                  UM data structure
+*      const char *path:        file to write the snapshot to
+*
+* Return: Nothing
+*
+* Expects:
+*      Expects T data to not be null, and path to stay valid while the
+*      program runs
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void snapshot_at_input(T data, const char *path)
+{
+        data->snapshot_path = path;
+}
+
+/* * * * * * * * * * * * * * * * * restore_data * * * * * * * * * * * * * * * *
+*
+* Rebuilds a machine from a snapshot file written at a blocking input.
+*
+* Parameters:
+*      const char *path:        snapshot file to restore
+*
+* Return: newly allocated Data object, registers included, that resumes at
+*         the input instruction (see get_program_counter)
+*
+* Expects:
+*      path names a snapshot written by this build of the UM
+*
+* Notes:
+*      The file is mapped privately and segments point into the mapping, so
+*      nothing is read or copied until the program touches it. An
+*      unreadable or malformed snapshot is rejected with EXIT_FAILURE.
+*      The mapping is removed in data_free
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+T restore_data(const char *path)
+{
+        int fd = open(path, O_RDONLY);
+        struct stat st;
+        uint8_t *bytes = MAP_FAILED;
+
+        if (fd >= 0 && fstat(fd, &st) == 0 &&
+            (size_t) st.st_size >= sizeof(struct Snapshot_header)) {
+                bytes = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE, fd, 0);
+        }
+        if (fd >= 0) {
+                close(fd);
+        }
+
+        struct Snapshot_header *header = (struct Snapshot_header *) bytes;
+        size_t length = (bytes == MAP_FAILED) ? 0 : st.st_size;
+
+        if (bytes == MAP_FAILED ||
+            memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0
+            || header->size == 0 || sizeof(*header) + (uint64_t)
+            header->size * sizeof(struct Snapshot_entry) > length) {
+                fprintf(stderr, "Invalid snapshot file");
+                exit(EXIT_FAILURE);
+        }
+
+        struct Snapshot_entry *entries = (struct Snapshot_entry *)
+                                         (header + 1);
+        T data = new_data(header->size);
+
+        data->restored = bytes;
+        data->restored_length = length;
+        data->size = header->size;
+        data->free_head = header->free_head;
+        data->memory_index = header->memory_index;
+        memcpy(data->registers, header->registers, sizeof(header->registers));
+
+        for (uint32_t i = 0; i < header->size; i++) {
+                uint64_t offset = entries[i].offset;
+
+                if (offset == 0) {
+                        data->memory[i] = FREE_ENTRY(entries[i].length);
+                        continue;
+                }
+                if (offset + ((uint64_t) entries[i].length + HEADER_WORDS) *
+                    sizeof(uint32_t) > length || offset % SNAPSHOT_ALIGN) {
+                        fprintf(stderr, "Invalid snapshot file");
+                        exit(EXIT_FAILURE);
+                }
+                data->memory[i] = (uint32_t *) (bytes + offset) +
+                                  HEADER_WORDS;
+                if (LENGTH(data->memory[i]) != entries[i].length) {
+                        fprintf(stderr, "Invalid snapshot file");
+                        exit(EXIT_FAILURE);
+                }
+                REFS(data->memory[i]) &= ~WATCHED;
+        }
+
+        decode_segment_0(data);
+        return data;
+}
+
+/* * * * * * * * * * * * * * * * * flush_output * * * * * * * * * * * * * * *
+*
+* Writes everything waiting in the machine's output buffer.
+*
+* Parameters:
+*      T data:          UM data structure
+*
+* Return: Nothing
+*
+* Expects:
+*      Expects T data to not be null
+*
+* Notes:
+*      Output that cannot be written (such as to a closed pipe) is dropped,
+*      as putchar would have done. With an output callback the whole buffer
+*      goes to one call.
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void flush_output(T data)
+{
+        size_t done = 0;
+
+        if (data->writer != NULL && data->output_length > 0) {
+                data->writer(data->io_cl, data->output, data->output_length);
+                done = data->output_length;
+        }
+
+        while (done < data->output_length) {
+                ssize_t n = write(data->output_fd, data->output + done,
+                                  data->output_length - done);
+                if (n < 0 && errno == EINTR) {
+                        continue;
+                } else if (n <= 0) {
+                        break;
+                }
+                done += n;
+        }
+        data->output_length = 0;
+}
+
+/* * * * * * * * * * * * * * * * * put_output * * * * * * * * * * * * * * * *
+*
+* Adds one character to the machine's output buffer.
+*
+* Parameters:
+*      T data:          UM data structure
+*      char c:          character to output
+*
+* Return: Nothing
+*
+* Expects:
+*      Expects T data to not be null
+*
+* Notes:
+*      The buffer is written when it fills, at each newline when output is
+*      a terminal, before input blocks, and in data_free
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void put_output(T data, char c)
+{
+        data->output[data->output_length++] = c;
+
+        if (data->output_length == IO_BUFFER ||
+            (c == '\n' && data->output_lines)) {
+                flush_output(data);
+        }
+}
+
+/* * * * * * * * * * * * * * * * * get_input * * * * * * * * * * * * * * * * *
+*
+* Takes the next character from the machine's input buffer, refilling it
+* with one read when it is empty.
+*
+* Parameters:
+*      T data:          UM data structure
+*
+* Return: the character, from 0 to 255, or EOF once input is exhausted
+*
+* Expects:
+*      Expects T data to not be null
+*
+* Notes:
+*      Pending output is flushed before a read that may block, so prompts
+*      appear before an interactive program waits for its answer. Batch
+*      output set up by set_output_fd skips that flush. A snapshot
+*      requested with snapshot_at_input is written before the first such
+*      read.
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+int get_input(T data)
+{
+        if (data->input_pos == data->input_length) {
+                if (data->input_eof) {
+                        return EOF;
+                }
+                if (!data->output_batch) {
+                        flush_output(data);
+                }
+                if (data->snapshot_path != NULL) {
+                        save_snapshot(data);
+                        data->snapshot_path = NULL;
+                }
+
+                ssize_t n;
+                if (data->reader != NULL) {
+                        n = data->reader(data->io_cl, data->input,
+                                         IO_BUFFER);
+                } else {
+                        do {
+                                n = read(data->input_fd, data->input,
+                                         IO_BUFFER);
+                        } while (n < 0 && errno == EINTR);
+                }
+
+                if (n <= 0) {
+                        data->input_eof = true;
+                        return EOF;
+                }
+                data->input_pos = 0;
+                data->input_length = n;
+        }
+
+        return data->input[data->input_pos++];
+}
+
+/* * * * * * * * * * * * * * * * * set_input_fd * * * * * * * * * * * * * * *
+*
+* Makes the machine's input instructions read from a file descriptor
+* instead of standard input.
+*
+* Parameters:
+*      T data:          UM data structure
+*      int fd:          open file descriptor to read input from
+*
+* Return: Nothing
+*
+* Expects:
+*      Expects T data to not be null, no input to have been read yet, and
+*      fd to stay open until the program halts
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void set_input_fd(T data, int fd)
+{
+        assert(data != NULL);
+        data->input_fd = fd;
+        data->input_eof = false;
+        data->input_pos = 0;
+        data->input_length = 0;
+}
+
+/* * * * * * * * * * * * * * * * set_io_callbacks * * * * * * * * * * * * * *
+*
+* Routes the machine's input and output through functions instead of file
+* descriptors, for programs embedded in another process.
+*
+* Parameters:
+*      T data:                  UM data structure
+*      Input_reader reader:     fills the input buffer, or NULL for input_fd
+*      Output_writer writer:    takes buffered output, or NULL for output_fd
+*      void *cl:                passed to both callbacks
+*
+* Return: Nothing
+*
+* Expects:
+*      Expects T data to not be null
+*
+* Notes:
+*      reader returns the number of bytes it stored, 0 at end of input.
+*      Output is buffered as for a file and flushed before each read, when
+*      the buffer fills, by flush_output and by data_free.
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void set_io_callbacks(T data, Input_reader reader, Output_writer writer,
+                      void *cl)
+{
+        assert(data != NULL);
+        flush_output(data);
+        data->reader = reader;
+        data->writer = writer;
+        data->io_cl = cl;
+        data->output_lines = false;
+        data->output_batch = false;
+}
+
+/* * * * * * * * * * * * * * * * * set_output_fd * * * * * * * * * * * * * * *
+*
+* Sends the machine's output straight to a file descriptor in batch mode:
+* the buffer is written only when it fills and when the machine is freed.
+*
+* Parameters:
+*      T data:          UM data structure
+*      int fd:          open file descriptor to write output to
+*
+* Return: Nothing
+*
+* Expects:
+*      Expects T data to not be null and fd to stay open until data_free
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void set_output_fd(T data, int fd)
+{
+        flush_output(data);
+        data->output_fd = fd;
+        data->output_batch = true;
+        data->output_lines = false;
+}
+
+/* * * * * * * * * * * * * * * * * data_stats * * * * * * * * * * * * * * * *
+*
+* Prints statistics about the data layer, such as the segment pool's hit
+* rate, to a stream.
+*
+* Parameters:
+*      T data:          UM data structure
+*      FILE *out:       stream to print to
+*
+* Return: Nothing
+*
+* Expects:
+*      Expects T data and out to not be null
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void data_stats(T data, FILE *out)
+{
+        uint64_t total = data->pool_hits + data->pool_misses;
+
+        fprintf(out, "segment pool: %llu allocations, %llu hits, "
+                     "%llu misses (%.1f%% hit rate), %zu bytes pooled\n",
+                (unsigned long long) total,
+                (unsigned long long) data->pool_hits,
+                (unsigned long long) data->pool_misses,
+                total == 0 ? 0.0 : 100.0 * data->pool_hits / total,
+                data->pool_bytes);
+
+        if (data->huge_min != 0) {
+                fprintf(out, "huge pages: %llu segments of %u words or "
+                             "more, %llu bytes now on huge pages\n",
+                        (unsigned long long) data->huge_segments,
+                        data->huge_min,
+                        (unsigned long long) huge_page_bytes());
+        }
+        if (data->code_hits + data->code_misses != 0) {
+                fprintf(out, "code cache: %llu programs loaded, %llu from "
+                             "the cache, %zu bytes cached\n",
+                        (unsigned long long) (data->code_hits +
+                                              data->code_misses),
+                        (unsigned long long) data->code_hits,
+                        data->code_cache_bytes);
+        }
+        if (data->words_removed != 0) {
+                fprintf(out, "optimizer: %llu instructions removed from "
+                             "segment 0 (%llu constant runs folded, %llu "
+                             "ORs fused)\n",
+                        (unsigned long long) data->words_removed,
+                        (unsigned long long) data->folded_runs,
+                        (unsigned long long) data->or_idioms);
+        }
+        if (data->code_faults != 0) {
+                size_t pages = (data->code_end - data->code_start) /
+                               page_size;
+                size_t volatile_pages = 0;
+                for (size_t i = 0; i < pages; i++) {
+                        volatile_pages += data->page_faults[i] >=
+                                          VOLATILE_FAULTS;
+                }
+                fprintf(out, "segment 0: %llu pages invalidated by stores, "
+                             "%zu of %zu left writable\n",
+                        (unsigned long long) data->code_faults,
+                        volatile_pages, pages);
+        }
+}
+
 /* * * * * * * * * * * * * * * * * data_free * * * * * * * * * * * * * * * *
 *
 * Takes in a pointer to the data struct and frees all memory associated with
@@ -483,20 +3295,58 @@ void data_free(T *data)
         // assert(data != NULL);
         // assert(*data != NULL);
 
+        flush_output(*data);
+        unprotect_code(*data);
+        flush_code_cache(*data);
+        if (barrier_machine == *data) {
+                barrier_machine = NULL;
+        }
+
         /* Free each sequence in data->memory sequence */
         // int size = Seq_length((*data)->memory);
-        int size = (*data)->size;
-        for (int i = 0; i < size; i++) {
+        uint32_t size = (*data)->size;
+        for (uint32_t i = 0; i < size; i++) {
                 // Seq_T curr = Seq_get((*data)->memory, i);
                 // Seq_free(&curr);
 
-                free((*data)->memory[i]);
+                if (!IS_FREE((*data)->memory[i])) {
+                        release_segment(*data, (*data)->memory[i]);
+                }
+        }
+
+        /* Return the recycled buffers held by the pool */
+        for (int class = 0; class <= POOL_MAX_CLASS; class++) {
+                void *block = (*data)->pool[class];
+                while (block != NULL) {
+                        void *next = *(void **) block;
+                        free(block);
+                        block = next;
+                }
+        }
+        for (int class = 0; class < MAX_CLASS; class++) {
+                void *block = (*data)->lazy[class];
+                while (block != NULL) {
+                        void *next = *(void **) block;
+                        munmap(block, buffer_bytes(class));
+                        block = next;
+                }
         }
 
-        free((*data)->memory);
-        // Seq_free(&((*data)->memory));
-        free((*data)->seg_sizes);
-        Seq_free(&(*data)->unmaps);
+        if ((*data)->table_reserved) {
+                munmap((*data)->memory, TABLE_ENTRIES * sizeof(uint32_t *));
+        } else {
+                free((*data)->memory);
+                // Seq_free(&((*data)->memory));
+        }
+        free((*data)->decoded);
+        free((*data)->folds);
+        free((*data)->page_faults);
+        if ((*data)->code_spare != NULL) {
+                munmap((*data)->code_spare, (*data)->code_spare_bytes);
+        }
+        if ((*data)->restored != NULL) {
+                munmap((*data)->restored, (*data)->restored_length);
+        }
         free(*data);
 }
 
@@ -18,23 +18,123 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include "assert.h"
-#include "seq.h"
 
 #define T Data
 typedef struct T *T;
 
+/* struct Instruction
+*
+* A word of segment 0 with its opcode and operands already unpacked. For
+* load_val (opcode 13), a holds the destination register and value the
+* 25-bit immediate; for every other opcode a, b and c are the registers.
+*/
+typedef struct Instruction {
+        uint8_t opcode;
+        uint8_t a;
+        uint8_t b;
+        uint8_t c;
+        uint32_t value;
+} Instruction;
+
+/*
+ * Opcodes past the fourteen of the UM, which stand for a decoded entry
+ * fused with the one after it into a single dispatch (see set_fusion).
+ * The fused entry keeps its own operands and the second is left in place,
+ * so a jump to the second still runs it alone. FUSED_OR stands for the
+ * three NANDs of an OR (two NOTs and the NAND of their results), and
+ * FUSED_CONSTANTS for a run of words that only computes constants, which
+ * starts with a load_val whose b and c hold an index into
+ * folded_constants (b + 256 * c). Both skip the words they stand for.
+ */
+enum Fused_opcode {
+        FUSED_LOADVAL_LOADVAL = 16,
+        FUSED_LOADVAL_LOAD,
+        FUSED_LOADVAL_STORE,
+        FUSED_LOADVAL_LOADPROG,
+        FUSED_NAND_NAND,
+        FUSED_OR,
+        FUSED_CONSTANTS,
+        FUSED_END
+};
+
+/* struct Fold
+*
+* What a run of length words of segment 0 leaves in the registers when all
+* it computes are constants: values[r] for each register r in mask. The
+* registers outside mask are those the run does not change. head is the
+* word the run starts at.
+*/
+typedef struct Fold {
+        uint32_t values[8];
+        uint32_t head;
+        uint8_t mask;
+        uint8_t length;
+} Fold;
+
+/*
+ * Opcode of the decoded entries of a page of segment 0 that was stored to
+ * since it was decoded. Whoever reaches one runs what refresh_code returns
+ * in its place.
+ */
+#define STALE_OPCODE FUSED_END
+
 extern T initialize_data(FILE *fp);
+extern T initialize_data_bytes(const uint8_t *bytes, size_t length);
+extern T restore_data(const char *path);
+extern void snapshot_at_input(T data, const char *path);
+
+/*
+ * Called with the index of each word of segment 0 a store may change (the
+ * whole page it lands on, unless segment 0 is watched word by word), or
+ * with -1 when the whole program is about to be replaced
+ */
+typedef void (*Code_watcher)(void *cl, int word_index);
 
+extern uint32_t get_program_counter(T data);
+extern void set_program_counter(T data, uint32_t pc);
 extern uint32_t extract_word(T data);
+extern uint32_t *segment_zero(T data);
+extern Instruction *decoded_segment_zero(T data);
+extern void watch_segment_0(T data, Code_watcher watcher, void *cl);
+extern void set_fusion(T data, bool on);
+extern Fold *folded_constants(T data);
+extern Instruction refresh_code(T data, uint32_t word_index);
+extern void use_write_barrier(T data);
+extern void attach_thread(T data);
+extern bool code_write_fault(const void *address);
+extern void set_huge_pages(T data, uint32_t min_words);
+extern void guard_segments(T data);
+extern bool segment_at_address(T data, const void *address,
+                               uint32_t *segment_index, int64_t *word_index);
+extern uint32_t segment_length(T data, int segment_index);
 extern uint32_t get_word(T data, int segment_index, int word_index);
 extern void set_word(T data, int segment_index, int word_index, uint32_t word);
 
 extern uint32_t get_register(T data, int register_num);
 extern void set_register(T data, int register_num, uint32_t value);
+extern uint32_t *data_registers(T data);
+extern uint32_t ***segment_table(T data);
 extern void replace_segment_0(T data, int segment_index, int memory_index); 
 extern void set_segment_false(T data, int segment_index);
 extern int insert_segment(T data, int size);
 
+/*
+ * Callbacks that stand in for the input and output file descriptors: the
+ * reader stores up to size bytes of input and returns how many (0 at end
+ * of input), the writer takes length bytes of output
+ */
+typedef size_t (*Input_reader)(void *cl, uint8_t *buffer, size_t size);
+typedef void (*Output_writer)(void *cl, const uint8_t *bytes, size_t length);
+
+extern void put_output(T data, char c);
+extern int get_input(T data);
+extern void flush_output(T data);
+extern void set_input_fd(T data, int fd);
+extern void set_output_fd(T data, int fd);
+extern void set_io_callbacks(T data, Input_reader reader, Output_writer writer,
+                             void *cl);
+
+extern void data_stats(T data, FILE *out);
 extern void data_free(T *data);
 
 #undef T
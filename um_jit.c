@@ -0,0 +1,632 @@
+/* * * * * * * * * * * * * * * * * um_jit.c * * * * * * * * * * * * * * * * * *
+*
+*     Assignment: CS40 Universal Machine
+*     Authors:  Andrea Cabochan, Chance Rebish
+*     Date:     April 04, 2025
+*
+*     Summary:
+*     Optional JIT tier for the Universal Machine. Basic blocks of segment 0
+*     are compiled into x86-64 code the first time they are reached and run
+*     with the eight UM registers held in r8d-r15d. A block ends at
+*     load_program, halt, input or output; halt and I/O are carried out here
+*     in C between blocks. Compiled code is thrown away whenever a store
+*     lands on a page of segment 0 holding a word some block was compiled
+*     from (see code_write_fault), or replace_segment_0 installs a new
+*     program.
+*
+*     A jump within segment 0 (load_program of segment 0) checks the few
+*     targets last seen at its site and goes straight to their compiled
+*     block, so loops and returns stay in generated code; it leaves to C
+*     only when the target is new to the site.
+*
+*     Loads and stores index the segment table directly. A store goes to
+*     set_word only when its segment is shared or watched, so the common
+*     case never calls back into C.
+*
+*     On hosts other than x86-64, or if executable memory cannot be mapped,
+*     jit_run returns false and the caller falls back to run_um.
+*
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include "um_jit.h"
+#include "um_data.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include "assert.h"
+
+#if defined(__x86_64__)
+
+#include <sys/mman.h>
+
+#define CODE_SIZE (32 << 20)    /* Bytes of executable memory */
+#define MAX_BLOCK 256           /* Most UM instructions in one block */
+#define MAX_INSTR_BYTES 128     /* Most bytes emitted for one instruction */
+#define JUMP_WAYS 4             /* Targets remembered for each jump site */
+#define MAX_SITES (1 << 16)     /* Jump sites with a cache */
+
+/* Host register numbers as encoded in ModRM and REX */
+enum { EAX = 0, ECX, EDX, EBX, ESP, EBP, ESI, EDI };
+
+/* UM register i lives in host register r(8 + i) */
+#define UM(i) (8 + (i))
+
+/* struct Jump_site
+*
+* Inline cache of one load_program of segment 0: the last JUMP_WAYS targets
+* it jumped to and the compiled blocks for them. Generated code compares
+* the target with each of targets and jumps through the matching entry.
+* Unused ways hold UINT32_MAX and the exit stub.
+*/
+struct Jump_site {
+        uint32_t targets[JUMP_WAYS];
+        void *entries[JUMP_WAYS];
+        uint32_t next;                  /* Way the next new target replaces */
+};
+
+/* struct Jit
+*
+* State of one JIT run. The first five fields are read or written by
+* generated code through rbx, so their offsets must stay below 128.
+*/
+struct Jit {
+        Data data;                      /* Machine being run */
+        uint32_t *registers;            /* UM register file in memory */
+        uint8_t stale;                  /* Compiled code no longer valid */
+        struct Jump_site *missed;       /* Site whose targets all missed */
+        uint32_t ***table;              /* Where the segment table is */
+
+        uint8_t *code;                  /* Executable buffer */
+        uint8_t *blocks;                /* First byte after the stubs */
+        uint8_t *next;                  /* Where the next block is emitted */
+        uint8_t *exit;                  /* Stub that returns to C */
+        uint32_t (*enter)(struct Jit *jit, void *block);
+
+        void **entries;                 /* Compiled block for each pc */
+        uint8_t *covered;               /* Words some block was built from */
+        uint32_t length;                /* Segment 0 length of the tables */
+
+        struct Jump_site *sites;        /* Caches of the compiled jumps */
+        uint32_t site_count;
+};
+
+/* * * * * * * * * * * * * * * * * emitters * * * * * * * * * * * * * * * * *
+*
+* Append machine code to the buffer. emit_rr encodes a one-byte opcode with
+* a register-direct ModRM, emit_0f_rr the same for 0F-prefixed opcodes; both
+* add a REX prefix only when an extended register is involved.
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static inline void emit8(struct Jit *jit, uint8_t byte)
+{
+        *jit->next++ = byte;
+}
+
+static inline void emit32(struct Jit *jit, uint32_t value)
+{
+        memcpy(jit->next, &value, sizeof(value));
+        jit->next += sizeof(value);
+}
+
+static inline void emit64(struct Jit *jit, uint64_t value)
+{
+        memcpy(jit->next, &value, sizeof(value));
+        jit->next += sizeof(value);
+}
+
+static inline void emit_rex(struct Jit *jit, int reg, int rm)
+{
+        uint8_t rex = 0x40 | ((reg & 8) ? 0x4 : 0) | ((rm & 8) ? 0x1 : 0);
+
+        if (rex != 0x40) {
+                emit8(jit, rex);
+        }
+}
+
+static void emit_rr(struct Jit *jit, uint8_t op, int reg, int rm)
+{
+        emit_rex(jit, reg, rm);
+        emit8(jit, op);
+        emit8(jit, 0xC0 | (reg & 7) << 3 | (rm & 7));
+}
+
+static void emit_0f_rr(struct Jit *jit, uint8_t op, int reg, int rm)
+{
+        emit_rex(jit, reg, rm);
+        emit8(jit, 0x0F);
+        emit8(jit, op);
+        emit8(jit, 0xC0 | (reg & 7) << 3 | (rm & 7));
+}
+
+/* mov dst, src on 32-bit registers */
+static inline void emit_mov(struct Jit *jit, int dst, int src)
+{
+        emit_rr(jit, 0x89, src, dst);
+}
+
+/* mov eax, imm32; jmp exit -- leave the block with the next pc in eax */
+static void emit_exit(struct Jit *jit, uint32_t pc)
+{
+        emit8(jit, 0xB8);
+        emit32(jit, pc);
+        emit8(jit, 0xE9);
+        emit32(jit, (uint32_t) (jit->exit - (jit->next + 4)));
+}
+
+/*
+ * Calls a C function with data in rdi. The UM registers in r8d-r11d are
+ * caller-saved, so they are pushed around the call; four pushes keep the
+ * stack 16-byte aligned.
+ */
+static void emit_call(struct Jit *jit, uintptr_t function)
+{
+        for (int i = 0; i < 4; i++) {
+                emit8(jit, 0x41);
+                emit8(jit, 0x50 + i);           /* push r8..r11 */
+        }
+        emit8(jit, 0x48);
+        emit8(jit, 0x89);
+        emit8(jit, 0xEF);                       /* mov rdi, rbp */
+        emit8(jit, 0x48);
+        emit8(jit, 0xB8);
+        emit64(jit, function);                  /* mov rax, fn */
+        emit8(jit, 0xFF);
+        emit8(jit, 0xD0);                       /* call rax */
+        for (int i = 3; i >= 0; i--) {
+                emit8(jit, 0x41);
+                emit8(jit, 0x58 + i);           /* pop r11..r8 */
+        }
+}
+
+/* mov rax, (*table)[reg] -- word 0 of the segment a UM register names */
+static void emit_segment(struct Jit *jit, int reg)
+{
+        emit8(jit, 0x48); emit8(jit, 0x8B); emit8(jit, 0x43);
+        emit8(jit, offsetof(struct Jit, table));        /* mov rax, [..] */
+        emit8(jit, 0x48); emit8(jit, 0x8B); emit8(jit, 0x00); /* [rax] */
+        emit8(jit, 0x4A); emit8(jit, 0x8B); emit8(jit, 0x04);
+        emit8(jit, 0xC0 | (reg & 7) << 3);      /* mov rax, [rax+reg*8] */
+}
+
+/*
+ * Loads word c of segment b into a, and stores c into word b of segment
+ * a when nothing else shares the segment, calling set_word otherwise. UM
+ * registers are kept zero-extended, so they index as 64-bit registers.
+ */
+static void emit_load(struct Jit *jit, int a, int b, int c)
+{
+        emit_segment(jit, b);
+        emit8(jit, 0x46); emit8(jit, 0x8B);
+        emit8(jit, 0x04 | (a & 7) << 3);
+        emit8(jit, 0x80 | (c & 7) << 3);        /* mov a, [rax+c*4] */
+}
+
+static void emit_store(struct Jit *jit, int a, int b, int c)
+{
+        emit_segment(jit, a);
+        emit8(jit, 0x83); emit8(jit, 0x78);
+        emit8(jit, 0xFC); emit8(jit, 0x01);     /* cmp dword [rax-4], 1 */
+        emit8(jit, 0x75); emit8(jit, 6);        /* jne to the call */
+        emit8(jit, 0x46); emit8(jit, 0x89);
+        emit8(jit, 0x04 | (c & 7) << 3);
+        emit8(jit, 0x80 | (b & 7) << 3);        /* mov [rax+b*4], c */
+        emit8(jit, 0xEB);                       /* jmp over the call */
+        uint8_t *over = jit->next++;
+
+        emit_mov(jit, ESI, a);
+        emit_mov(jit, EDX, b);
+        emit_mov(jit, ECX, c);
+        emit_call(jit, (uintptr_t) set_word);
+        *over = (uint8_t) (jit->next - (over + 1));
+}
+
+/* * * * * * * * * * * * * * * * * emit_jump * * * * * * * * * * * * * * * *
+*
+* Emits a jump within segment 0 to the pc in eax: through the site's cache
+* when one is left, otherwise to the exit stub.
+*
+* Parameters:
+*      struct Jit *jit:      JIT with room for the jump
+*
+* Return: nothing
+*
+* Notes:
+*      A miss leaves the site in jit->missed for jit_run, which adds the
+*      target once it has the block for it
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static void emit_jump(struct Jit *jit)
+{
+        if (jit->site_count < MAX_SITES) {
+                struct Jump_site *site = &jit->sites[jit->site_count++];
+
+                for (int i = 0; i < JUMP_WAYS; i++) {
+                        site->targets[i] = UINT32_MAX;
+                        site->entries[i] = jit->exit;
+                }
+                site->next = 0;
+
+                emit8(jit, 0x48);
+                emit8(jit, 0xBA);
+                emit64(jit, (uintptr_t) site);  /* mov rdx, site */
+                for (int i = 0; i < JUMP_WAYS; i++) {
+                        emit8(jit, 0x3B); emit8(jit, 0x42);
+                        emit8(jit, offsetof(struct Jump_site, targets) +
+                                   4 * i);      /* cmp eax, [rdx+..] */
+                        emit8(jit, 0x75); emit8(jit, 3);        /* jne */
+                        emit8(jit, 0xFF); emit8(jit, 0x62);
+                        emit8(jit, offsetof(struct Jump_site, entries) +
+                                   8 * i);      /* jmp [rdx+..] */
+                }
+                emit8(jit, 0x48); emit8(jit, 0x89); emit8(jit, 0x53);
+                emit8(jit, offsetof(struct Jit, missed));   /* mov [..], rdx */
+        }
+        emit8(jit, 0xE9);
+        emit32(jit, (uint32_t) (jit->exit - (jit->next + 4)));
+}
+
+/* * * * * * * * * * * * * * * * * emit_stubs * * * * * * * * * * * * * * * *
+*
+* Emits the entry trampoline, uint32_t enter(struct Jit *jit, void *block),
+* which saves the callee-saved registers, loads the UM registers and jumps
+* to the block, and the exit stub, which stores them back and returns the
+* pc left in eax.
+*
+* Parameters:
+*      struct Jit *jit:      JIT whose buffer is empty
+*
+* Return: nothing
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static void emit_stubs(struct Jit *jit)
+{
+        uint8_t *enter = jit->next;
+
+        emit8(jit, 0x53);                       /* push rbx */
+        emit8(jit, 0x55);                       /* push rbp */
+        for (int i = 4; i < 8; i++) {
+                emit8(jit, 0x41);
+                emit8(jit, 0x50 + i);           /* push r12..r15 */
+        }
+        emit8(jit, 0x48); emit8(jit, 0x83);
+        emit8(jit, 0xEC); emit8(jit, 0x08);     /* sub rsp, 8 */
+        emit8(jit, 0x48); emit8(jit, 0x89);
+        emit8(jit, 0xFB);                       /* mov rbx, rdi */
+        emit8(jit, 0x48); emit8(jit, 0x8B); emit8(jit, 0x6B);
+        emit8(jit, offsetof(struct Jit, data)); /* mov rbp, [rbx+data] */
+        emit8(jit, 0x48); emit8(jit, 0x8B); emit8(jit, 0x43);
+        emit8(jit, offsetof(struct Jit, registers));    /* mov rax, [..] */
+        for (int i = 0; i < 8; i++) {
+                emit8(jit, 0x44); emit8(jit, 0x8B);
+                emit8(jit, 0x40 | i << 3);
+                emit8(jit, 4 * i);              /* mov r(8+i)d, [rax+4i] */
+        }
+        emit8(jit, 0xFF); emit8(jit, 0xE6);     /* jmp rsi */
+
+        jit->exit = jit->next;
+        emit8(jit, 0x48); emit8(jit, 0x8B); emit8(jit, 0x4B);
+        emit8(jit, offsetof(struct Jit, registers));    /* mov rcx, [..] */
+        for (int i = 0; i < 8; i++) {
+                emit8(jit, 0x44); emit8(jit, 0x89);
+                emit8(jit, 0x41 | i << 3);
+                emit8(jit, 4 * i);              /* mov [rcx+4i], r(8+i)d */
+        }
+        emit8(jit, 0x48); emit8(jit, 0x83);
+        emit8(jit, 0xC4); emit8(jit, 0x08);     /* add rsp, 8 */
+        for (int i = 7; i >= 4; i--) {
+                emit8(jit, 0x41);
+                emit8(jit, 0x58 + i);           /* pop r15..r12 */
+        }
+        emit8(jit, 0x5D);                       /* pop rbp */
+        emit8(jit, 0x5B);                       /* pop rbx */
+        emit8(jit, 0xC3);                       /* ret */
+
+        /* Object to function pointer casts are not ISO C, so copy it */
+        memcpy(&jit->enter, &enter, sizeof(enter));
+        jit->blocks = jit->next;
+}
+
+/* * * * * * * * * * * * * * * * * compile_block * * * * * * * * * * * * * * *
+*
+* Compiles the basic block of segment 0 that starts at pc.
+*
+* Parameters:
+*      struct Jit *jit:      JIT with room for a full block
+*      uint32_t pc:          index of the block's first instruction
+*
+* Return: the block's entry point
+*
+* Expects:
+*      pc is inside segment 0 and does not hold halt, input or output
+*
+* Notes:
+*      Every word the block was built from is marked as covered, so a later
+*      store to it makes the whole cache stale
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static void *compile_block(struct Jit *jit, uint32_t pc)
+{
+        Instruction *program = decoded_segment_zero(jit->data);
+        uint8_t *entry = jit->next;
+        uint32_t end = pc + MAX_BLOCK;
+
+        if (end > jit->length) {
+                end = jit->length;
+        }
+
+        for (; pc < end; pc++) {
+                Instruction *ins = &program[pc];
+                if (ins->opcode == STALE_OPCODE) {
+                        refresh_code(jit->data, pc);
+                }
+                int a = UM(ins->a), b = UM(ins->b), c = UM(ins->c);
+
+                jit->covered[pc] = 1;
+
+                switch (ins->opcode) {
+                case 0:
+                        emit_rr(jit, 0x85, c, c);       /* test c, c */
+                        emit_0f_rr(jit, 0x45, a, b);    /* cmovne a, b */
+                        break;
+                case 1:
+                        emit_load(jit, a, b, c);
+                        break;
+                case 2:
+                        emit_store(jit, a, b, c);
+
+                        /* cmp byte [rbx+stale], 0; je over the exit */
+                        emit8(jit, 0x80); emit8(jit, 0x7B);
+                        emit8(jit, offsetof(struct Jit, stale));
+                        emit8(jit, 0x00);
+                        emit8(jit, 0x74); emit8(jit, 10);
+                        emit_exit(jit, pc + 1);
+                        break;
+                case 3:
+                        emit_mov(jit, EAX, b);
+                        emit_rr(jit, 0x01, c, EAX);     /* add eax, c */
+                        emit_mov(jit, a, EAX);
+                        break;
+                case 4:
+                        emit_mov(jit, EAX, b);
+                        emit_0f_rr(jit, 0xAF, EAX, c);  /* imul eax, c */
+                        emit_mov(jit, a, EAX);
+                        break;
+                case 5:
+                        emit_mov(jit, EAX, b);
+                        emit8(jit, 0x31); emit8(jit, 0xD2);     /* xor edx */
+                        emit_rr(jit, 0xF7, 6, c);       /* div c */
+                        emit_mov(jit, a, EAX);
+                        break;
+                case 6:
+                        emit_mov(jit, EAX, b);
+                        emit_rr(jit, 0x21, c, EAX);     /* and eax, c */
+                        emit8(jit, 0xF7); emit8(jit, 0xD0);     /* not eax */
+                        emit_mov(jit, a, EAX);
+                        break;
+                case 7:
+                case 10:
+                case 11:
+                        /* Halt and I/O are done by jit_run */
+                        emit_exit(jit, pc);
+                        return entry;
+                case 8:
+                        emit_mov(jit, ESI, c);
+                        emit_call(jit, (uintptr_t) insert_segment);
+                        emit_mov(jit, b, EAX);
+                        break;
+                case 9:
+                        emit_mov(jit, ESI, c);
+                        emit_call(jit, (uintptr_t) set_segment_false);
+                        break;
+                case 12: {
+                        /* test b, b; jnz to the replace_segment_0 call */
+                        emit_rr(jit, 0x85, b, b);
+                        emit8(jit, 0x75);
+                        uint8_t *skip = jit->next++;
+                        emit_mov(jit, EAX, c);
+                        emit_jump(jit);
+                        *skip = (uint8_t) (jit->next - (skip + 1));
+
+                        emit_mov(jit, ESI, b);
+                        emit_mov(jit, EDX, c);
+                        emit_call(jit, (uintptr_t) replace_segment_0);
+                        emit_mov(jit, EAX, c);
+                        emit8(jit, 0xE9);
+                        emit32(jit, (uint32_t) (jit->exit - (jit->next + 4)));
+                        return entry;
+                }
+                case 13:
+                        emit8(jit, 0x41);
+                        emit8(jit, 0xB8 + ins->a);      /* mov a, imm32 */
+                        emit32(jit, ins->value);
+                        break;
+                default:
+                        /* Opcodes 14 and 15 do nothing, as in run_um */
+                        break;
+                }
+        }
+
+        /* Block ran to its size limit or off the end of segment 0 */
+        emit_exit(jit, pc);
+        return entry;
+}
+
+/* * * * * * * * * * * * * * * * * reset_cache * * * * * * * * * * * * * * * *
+*
+* Discards every compiled block, and the jump caches that lead to them, and
+* sizes the tables for the current segment 0.
+*
+* Parameters:
+*      struct Jit *jit:      JIT to reset
+*
+* Return: nothing
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static void reset_cache(struct Jit *jit)
+{
+        jit->length = segment_length(jit->data, 0);
+
+        free(jit->entries);
+        free(jit->covered);
+        jit->entries = calloc(jit->length + 1, sizeof(void *));
+        jit->covered = calloc(jit->length + 1, sizeof(uint8_t));
+        assert(jit->entries != NULL && jit->covered != NULL);
+
+        jit->next = jit->blocks;
+        jit->stale = 0;
+        jit->missed = NULL;
+        jit->site_count = 0;
+}
+
+/* * * * * * * * * * * * * * * * * remember_jump * * * * * * * * * * * * * * *
+*
+* Adds a target to the cache of the jump site that missed it, in an unused
+* way if there is one and otherwise in place of the oldest target.
+*
+* Parameters:
+*      struct Jump_site *site:       site whose cache missed
+*      uint32_t pc:                  the target it jumped to
+*      void *block:                  compiled block at pc
+*
+* Return: nothing
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static void remember_jump(struct Jump_site *site, uint32_t pc, void *block)
+{
+        uint32_t way = site->next;
+
+        site->targets[way] = pc;
+        site->entries[way] = block;
+        site->next = (way + 1) % JUMP_WAYS;
+}
+
+/* * * * * * * * * * * * * * * * * watch_code * * * * * * * * * * * * * * * * *
+*
+* Segment 0 watcher: marks the cache stale when a store lands on the page
+* of a compiled word or the whole program is replaced. Generated code
+* checks the flag after every store and leaves the block, so stale code is
+* never run.
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static void watch_code(void *cl, int word_index)
+{
+        struct Jit *jit = cl;
+
+        if (word_index < 0 || (uint32_t) word_index >= jit->length ||
+            jit->covered[word_index]) {
+                jit->stale = 1;
+        }
+}
+
+/* * * * * * * * * * * * * * * * * * jit_run * * * * * * * * * * * * * * * * *
+*
+* Runs the loaded UM program to completion with the JIT.
+*
+* Parameters:
+*      Data data:            initialized UM data structure
+*      uint32_t registers[]: the eight UM registers
+*
+* Return: true once the program halts, false if the JIT is unavailable and
+*         nothing was run
+*
+* Expects:
+*      data is a valid, initialized UM Data structure
+*
+* Notes:
+*      Output and input go through the machine's buffers, as in run_um.
+*      Turns on the write barrier of segment 0 (see use_write_barrier).
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+bool jit_run(Data data, uint32_t registers[8])
+{
+        struct Jit jit;
+        memset(&jit, 0, sizeof(jit));
+
+        jit.code = mmap(NULL, CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (jit.code == MAP_FAILED) {
+                return false;
+        }
+
+        /* Blocks are compiled from plain decoded entries */
+        use_write_barrier(data);
+        set_fusion(data, false);
+        attach_thread(data);
+
+        jit.data = data;
+        jit.registers = registers;
+        jit.table = segment_table(data);
+        jit.sites = malloc(MAX_SITES * sizeof(*jit.sites));
+        assert(jit.sites != NULL);
+        jit.next = jit.code;
+        emit_stubs(&jit);
+        reset_cache(&jit);
+        watch_segment_0(data, watch_code, &jit);
+
+        uint32_t pc = get_program_counter(data);
+        int input;
+
+        for (;;) {
+                /* The block that just ran may have missed at a jump */
+                struct Jump_site *missed = jit.missed;
+                jit.missed = NULL;
+
+                if (jit.stale) {
+                        reset_cache(&jit);
+                        missed = NULL;
+                }
+
+                Instruction *ins = &decoded_segment_zero(data)[pc];
+                if (ins->opcode == STALE_OPCODE) {
+                        refresh_code(data, pc);
+                }
+
+                /* Halt and I/O end blocks and are carried out here */
+                if (ins->opcode == 7) {
+                        break;
+                } else if (ins->opcode == 10) {
+                        put_output(data, (char) registers[ins->c]);
+                        pc++;
+                        continue;
+                } else if (ins->opcode == 11) {
+                        set_program_counter(data, pc);
+                        input = get_input(data);
+                        if (input == EOF) {
+                                registers[ins->c] = 0xFFFFFFFF;
+                        } else if (input >= 0 && input <= 255) {
+                                registers[ins->c] = input;
+                        }
+                        pc++;
+                        continue;
+                }
+
+                void *block = jit.entries[pc];
+                if (block == NULL) {
+                        if (jit.code + CODE_SIZE - jit.next <
+                            MAX_BLOCK * MAX_INSTR_BYTES) {
+                                reset_cache(&jit);
+                                missed = NULL;
+                        }
+                        block = compile_block(&jit, pc);
+                        jit.entries[pc] = block;
+                }
+                if (missed != NULL) {
+                        remember_jump(missed, pc, block);
+                }
+
+                pc = jit.enter(&jit, block);
+        }
+
+        watch_segment_0(data, NULL, NULL);
+        free(jit.entries);
+        free(jit.covered);
+        free(jit.sites);
+        munmap(jit.code, CODE_SIZE);
+        return true;
+}
+
+#else
+
+bool jit_run(Data data, uint32_t registers[8])
+{
+        (void) data;
+        (void) registers;
+        return false;
+}
+
+#endif
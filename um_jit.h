@@ -0,0 +1,22 @@
+/* * * * * * * * * * * * * * * * * um_jit.h * * * * * * * * * * * * * * * * * *
+*
+*     Assignment: CS40 Universal Machine
+*     Authors:  Andrea Cabochan, Chance Rebish
+*     Date:     April 04, 2025
+*
+*     Summary:
+*     Declares the optional x86-64 JIT tier defined in um_jit.c, which runs
+*     segment 0 as natively compiled basic blocks
+*
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef UM_JIT_INCLUDED
+#define UM_JIT_INCLUDED
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "um_data.h"
+
+extern bool jit_run(Data data, uint32_t registers[8]);
+
+#endif
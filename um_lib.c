@@ -0,0 +1,209 @@
+/* * * * * * * * * * * * * * * * * um_lib.c * * * * * * * * * * * * * * * * * *
+*
+*     Assignment: CS40 Universal Machine
+*     Authors:  Andrea Cabochan, Chance Rebish
+*     Date:     April 04, 2025
+*
+*     Summary:
+*     Implements the libum embedding interface declared in um_lib.h on top
+*     of the data layer and run_um_budget. A UM wraps one Data and
+*     remembers the I/O callbacks, so that they carry over when a new
+*     program is loaded into it.
+*
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "assert.h"
+#include "um_data.h"
+#include "um_run.h"
+#include "um_lib.h"
+
+#define T UM
+
+struct T {
+        Data data;              /* NULL until a program is loaded */
+        bool halted;
+        Input_reader reader;
+        Output_writer writer;
+        void *cl;
+};
+
+/* * * * * * * * * * * * * * * * * * um_new * * * * * * * * * * * * * * * * * *
+*
+* Creates a machine with no program loaded
+*
+* Parameters: None
+*
+* Return: a new UM, to be freed with um_free
+*
+* Notes:
+*      Until um_set_io is called, the machine reads standard input and
+*      writes standard output
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+T um_new(void)
+{
+        T um = malloc(sizeof(struct T));
+        assert(um != NULL);
+
+        um->data = NULL;
+        um->halted = false;
+        um->reader = NULL;
+        um->writer = NULL;
+        um->cl = NULL;
+        return um;
+}
+
+/* * * * * * * * * * * * * * * * * * um_load * * * * * * * * * * * * * * * * *
+*
+* Loads a UM binary from memory, replacing whatever program the machine
+* was running, and resets it to start at pc 0 with zeroed registers
+*
+* Parameters:
+*      T um:                    the machine
+*      const uint8_t *bytes:    the program, in .um file format
+*      size_t length:           bytes in the program
+*
+* Return: true if the program was loaded, false if length is not a whole
+*         number of words (the machine is left as it was)
+*
+* Expects:
+*      um is not NULL, and bytes is not NULL unless length is 0
+*
+* Notes:
+*      bytes is copied; the caller keeps ownership of it. Output still
+*      buffered by the old program is flushed first.
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+bool um_load(T um, const uint8_t *bytes, size_t length)
+{
+        assert(um != NULL);
+        assert(bytes != NULL || length == 0);
+
+        Data data = initialize_data_bytes(bytes, length);
+        if (data == NULL) {
+                return false;
+        }
+
+        if (um->data != NULL) {
+                data_free(&um->data);
+        }
+
+        um->data = data;
+        um->halted = false;
+        if (um->reader != NULL || um->writer != NULL) {
+                set_io_callbacks(um->data, um->reader, um->writer, um->cl);
+        }
+        return true;
+}
+
+/* * * * * * * * * * * * * * * * * * um_set_io * * * * * * * * * * * * * * * *
+*
+* Sets the callbacks the machine uses for input and output instructions
+*
+* Parameters:
+*      T um:                    the machine
+*      Input_reader reader:     supplies input, or NULL for standard input
+*      Output_writer writer:    takes output, or NULL for standard output
+*      void *cl:                passed to both callbacks
+*
+* Return: Nothing
+*
+* Expects:
+*      um is not NULL
+*
+* Notes:
+*      The callbacks stay in place for later programs loaded with um_load.
+*      See set_io_callbacks in um_data.h for their contracts; they are
+*      called from um_run, on the thread running it.
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void um_set_io(T um, Input_reader reader, Output_writer writer, void *cl)
+{
+        assert(um != NULL);
+
+        um->reader = reader;
+        um->writer = writer;
+        um->cl = cl;
+        if (um->data != NULL) {
+                set_io_callbacks(um->data, reader, writer, cl);
+        }
+}
+
+/* * * * * * * * * * * * * * * * * * um_run * * * * * * * * * * * * * * * * * *
+*
+* Runs the loaded program for at most budget instructions
+*
+* Parameters:
+*      T um:            the machine
+*      uint64_t budget: instructions to run before returning
+*
+* Return: UM_HALTED once the program has halted (again on every later
+*         call), UM_RUNNING if the budget ran out first, or UM_NO_PROGRAM
+*
+* Expects:
+*      um is not NULL
+*
+* Notes:
+*      A paused machine picks up where it stopped on the next call. All
+*      output produced is flushed to the writer before returning. Use
+*      UINT64_MAX to run to completion.
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+UM_status um_run(T um, uint64_t budget)
+{
+        assert(um != NULL);
+
+        if (um->data == NULL) {
+                return UM_NO_PROGRAM;
+        }
+        if (!um->halted) {
+                um->halted = run_um_budget(um->data, budget);
+                flush_output(um->data);
+        }
+        return um->halted ? UM_HALTED : UM_RUNNING;
+}
+
+/* * * * * * * * * * * * * * * * * um_get_register * * * * * * * * * * * * * *
+*
+* Returns one of the machine's registers, e.g. to read a result at halt
+*
+* Parameters:
+*      T um:                    the machine
+*      int register_num:        register from 0 to 7
+*
+* Return: the register's value, 0 if no program is loaded
+*
+* Expects:
+*      um is not NULL and register_num is in range
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+uint32_t um_get_register(T um, int register_num)
+{
+        assert(um != NULL);
+        assert(register_num >= 0 && register_num < 8);
+
+        if (um->data == NULL) {
+                return 0;
+        }
+        return get_register(um->data, register_num);
+}
+
+/* * * * * * * * * * * * * * * * * * um_free * * * * * * * * * * * * * * * * *
+*
+* Frees a machine and its program, flushing any output still buffered
+*
+* Parameters:
+*      T *um: pointer to the machine, set to NULL
+*
+* Return: Nothing
+*
+* Expects:
+*      um and *um are not NULL
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void um_free(T *um)
+{
+        assert(um != NULL && *um != NULL);
+
+        if ((*um)->data != NULL) {
+                data_free(&(*um)->data);
+        }
+        free(*um);
+        *um = NULL;
+}
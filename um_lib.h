@@ -0,0 +1,49 @@
+/* * * * * * * * * * * * * * * * * um_lib.h * * * * * * * * * * * * * * * * * *
+*
+*     Assignment: CS40 Universal Machine
+*     Authors:  Andrea Cabochan, Chance Rebish
+*     Date:     April 04, 2025
+*
+*     Summary:
+*     The embedding interface of libum (make libum.a or make libum.so): a
+*     host program creates machines, loads UM binaries into them from
+*     memory, and runs them a slice of instructions at a time, with input
+*     and output going through callbacks. Machines share no state, so
+*     different threads may each run their own. libum installs no signal
+*     handlers: stores into segment 0 are checked as they are made rather
+*     than caught by the write barrier (see use_write_barrier). A host
+*     that turns the barrier on itself must load libum.so when it starts
+*     (link against it) rather than dlopen it later: the machine each
+*     thread's fault handler looks at lives in initial-exec thread-local
+*     storage, which a late dlopen may be unable to give it.
+*
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef UM_LIB_INCLUDED
+#define UM_LIB_INCLUDED
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "um_data.h"
+
+#define T UM
+typedef struct T *T;
+
+/* What um_run left the machine doing */
+typedef enum UM_status {
+        UM_HALTED,      /* the program ran a halt instruction */
+        UM_RUNNING,     /* the budget ran out; um_run again to go on */
+        UM_NO_PROGRAM   /* nothing has been loaded */
+} UM_status;
+
+extern T um_new(void);
+extern bool um_load(T um, const uint8_t *bytes, size_t length);
+extern void um_set_io(T um, Input_reader reader, Output_writer writer,
+                      void *cl);
+extern UM_status um_run(T um, uint64_t budget);
+extern uint32_t um_get_register(T um, int register_num);
+extern void um_free(T *um);
+
+#undef T
+#endif
@@ -0,0 +1,402 @@
+/* * * * * * * * * * * * * * * * * um_loop.h * * * * * * * * * * * * * * * * *
+*
+*     Assignment: CS40 Universal Machine
+*     Authors:  Andrea Cabochan, Chance Rebish
+*     Date:     April 04, 2025
+*
+*     Summary:
+*     The interpreter loop, written once and included by um_run.c for each
+*     variant of run_um it builds. Before including it, define
+*       RUN_UM                  the name of the function to define
+*       PUBLISH_PC(pc)          run before each instruction with its pc
+*       PUBLISH_LOAD(segment)   run before load_program with register B
+*     along with COUNT(op) and COUNT_MAP(size). Defining RUN_BUDGET as well
+*     builds bool RUN_UM(Data data, uint64_t budget) instead, which stops
+*     after budget instructions: it returns true if the program halted, and
+*     false with the pc saved (see set_program_counter) if it ran out.
+*     Defining RUN_FUSED adds handlers for the fused opcodes of um_data.h
+*     and turns fusion on (set_fusion) when the loop starts; otherwise it
+*     is turned off. A fused pair is one fetch, and a folded constant run
+*     or OR idiom one for all its words, so RUN_FUSED is not for loops
+*     that count or budget instructions. Every variant runs a stale
+*     entry (STALE_OPCODE) as the word decoded afresh by refresh_code.
+*     These are all undefined again at the end, so there is no include
+*     guard.
+*
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifdef RUN_BUDGET
+#define RUN_HEAD bool RUN_UM(Data data, uint64_t budget)
+#define RUN_HALT() return true
+#define SPEND(pc) do {                                  \
+                if (budget == 0) {                      \
+                        set_program_counter(data, pc);  \
+                        return false;                   \
+                }                                       \
+                budget--;                               \
+        } while (0)
+#else
+#define RUN_HEAD void RUN_UM(Data data)
+#define RUN_HALT() return
+#define SPEND(pc) ((void) 0)
+#endif
+
+#ifdef RUN_FUSED
+#define FUSION true
+#else
+#define FUSION false
+#endif
+
+
+#ifndef UM_THREADED_DISPATCH
+/* * * * * * * * * * * * * * * * RUN_UM * * * * * * * * * * * * * * *
+ *
+ * Executes the loaded UM program by repeatedly fetching and executing
+ * pre-decoded instructions from segment 0 until the halt instruction
+ * (opcode 7) is reached.
+ *
+ * Parameters:
+ *      Data data: the UM data structure containing registers, memory,
+ *                 and the program counter
+ *
+ * Return:
+ *      void
+ *
+ * Expects:
+ *      data is a valid, initialized UM Data structure
+ *
+ * Notes:
+ *      The function does not return until the halt instruction is executed.
+ *      Instructions come from the decoded copy of segment 0 kept by
+ *      um_data.c, so opcodes and registers are never unpacked here. The
+ *      decoded array is replaced on load_program and must be fetched again.
+ *      Modifies the internal state of `data` as it executes instructions.
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+RUN_HEAD
+{
+        uint32_t *registers = data_registers(data);
+        Instruction *program = decoded_segment_zero(data);
+        uint32_t pc = get_program_counter(data);
+        Instruction *ins, fresh;
+        int input;
+#ifdef RUN_FUSED
+        const Fold *fold;
+        uint32_t x, y;
+#endif
+
+        set_fusion(data, FUSION);
+        attach_thread(data);
+
+        for (;;) {
+                SPEND(pc);
+                ins = &program[pc++];
+                COUNT(ins->opcode);
+                PUBLISH_PC(pc - 1);
+
+                /* Switch case for each instruction */
+execute:
+                switch (ins->opcode) {
+                        case 0:
+                                if (registers[ins->c] != 0) {
+                                        registers[ins->a] = registers[ins->b];
+                                }
+                                break;
+                        case 1:
+                                registers[ins->a] = get_word(data, registers[ins->b], registers[ins->c]);
+                                break;
+                        case 2: 
+                                set_word(data, registers[ins->a], registers[ins->b], registers[ins->c]);
+                                break;
+                        case 3:
+                                registers[ins->a] = registers[ins->b] + registers[ins->c];
+                                break;
+                        case 4:
+                                registers[ins->a] = registers[ins->b] * registers[ins->c];
+                                break;
+                        case 5:
+                                registers[ins->a] = registers[ins->b] / registers[ins->c];
+                                break;
+                        case 6:
+                                registers[ins->a] = ~(registers[ins->b] & registers[ins->c]);
+                                break;
+                        case 7:
+                                RUN_HALT();
+                        case 8:
+                                COUNT_MAP(registers[ins->c]);
+                                registers[ins->b] = insert_segment(data, registers[ins->c]);
+                                break;
+                        case 9:
+                                set_segment_false(data, registers[ins->c]);
+                                break;
+                        case 10:
+                                put_output(data, (char) registers[ins->c]);
+                                break;
+                        case 11:
+                                set_program_counter(data, pc - 1);
+                                input = get_input(data);
+
+                                if (input == EOF) {
+                                        registers[ins->c] = 0xFFFFFFFF;
+                                } else {
+                                        if (input >= 0 && input <= 255) {
+                                                registers[ins->c] = input;         
+                                        }
+                                }
+                                break;
+                        case 12:
+                                /* Read C first, the old program is freed */
+                                pc = registers[ins->c];
+                                PUBLISH_LOAD(registers[ins->b]);
+                                replace_segment_0(data, registers[ins->b], pc);
+                                program = decoded_segment_zero(data);
+                                break;
+                        case 13: 
+                                registers[ins->a] = ins->value;
+                                break;
+                        case STALE_OPCODE:
+                                /* Its page was stored to since decoding */
+                                fresh = refresh_code(data, pc - 1);
+                                ins = &fresh;
+                                COUNT(ins->opcode);
+                                goto execute;
+#ifdef RUN_FUSED
+                        /* Each fused pair fetches and runs its second entry */
+                        case FUSED_LOADVAL_LOADVAL:
+                                registers[ins->a] = ins->value;
+                                ins = &program[pc++];
+                                registers[ins->a] = ins->value;
+                                break;
+                        case FUSED_LOADVAL_LOAD:
+                                registers[ins->a] = ins->value;
+                                ins = &program[pc++];
+                                registers[ins->a] = get_word(data, registers[ins->b], registers[ins->c]);
+                                break;
+                        case FUSED_LOADVAL_STORE:
+                                registers[ins->a] = ins->value;
+                                ins = &program[pc++];
+                                set_word(data, registers[ins->a], registers[ins->b], registers[ins->c]);
+                                break;
+                        case FUSED_LOADVAL_LOADPROG:
+                                registers[ins->a] = ins->value;
+                                ins = &program[pc++];
+                                pc = registers[ins->c];
+                                PUBLISH_LOAD(registers[ins->b]);
+                                replace_segment_0(data, registers[ins->b], pc);
+                                program = decoded_segment_zero(data);
+                                break;
+                        case FUSED_NAND_NAND:
+                                registers[ins->a] = ~(registers[ins->b] & registers[ins->c]);
+                                ins = &program[pc++];
+                                registers[ins->a] = ~(registers[ins->b] & registers[ins->c]);
+                                break;
+                        /* These two skip every word they stand for */
+                        case FUSED_OR:
+                                x = registers[ins->b];
+                                y = registers[program[pc].b];
+                                registers[ins->a] = ~x;
+                                registers[program[pc].a] = ~y;
+                                registers[program[pc + 1].a] = x | y;
+                                pc += 2;
+                                break;
+                        case FUSED_CONSTANTS:
+                                fold = &folded_constants(data)
+                                        [ins->b | ins->c << 8];
+                                for (x = fold->mask; x != 0; x &= x - 1) {
+                                        y = __builtin_ctz(x);
+                                        registers[y] = fold->values[y];
+                                }
+                                pc += fold->length - 1;
+                                break;
+#endif
+                }
+        }
+}
+#else
+/* Fetch the next decoded instruction and jump straight to its handler */
+#define DISPATCH() do {                                 \
+                SPEND(pc);                              \
+                ins = &program[pc++];                   \
+                COUNT(ins->opcode);                     \
+                PUBLISH_PC(pc - 1);                     \
+                goto *handlers[ins->opcode];            \
+        } while (0)
+
+/* Labels as values and computed goto are GNU extensions */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+
+/* * * * * * * * * * * * * * * * RUN_UM * * * * * * * * * * * * * * *
+ *
+ * Executes the loaded UM program with a direct-threaded dispatcher: every
+ * opcode has its own handler, and each handler ends by fetching the next
+ * decoded instruction of segment 0 and jumping through the handler table
+ * itself.
+ *
+ * Parameters:
+ *      Data data: the UM data structure containing registers, memory,
+ *                 and the program counter
+ *
+ * Return:
+ *      void
+ *
+ * Expects:
+ *      data is a valid, initialized UM Data structure
+ *
+ * Notes:
+ *      Built instead of the switch loop when UM_THREADED_DISPATCH is
+ *      defined (make DISPATCH=threaded). The decoded program and the
+ *      program counter are kept in locals, so the only calls out of this
+ *      function are for segment management and I/O. Opcodes 14 and 15 do
+ *      nothing, exactly as in the switch loop. A fused pair runs its first
+ *      entry and then goes straight to the handler of the second.
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+RUN_HEAD
+{
+        static void *const handlers[] = {
+                &&conditional_move, &&segment_load, &&segment_store,
+                &&add, &&multiplication, &&division, &&bitwise_nand,
+                &&halt, &&map_segment, &&unmap_segment, &&output,
+                &&input, &&load_program, &&load_val, &&invalid, &&invalid,
+#ifdef RUN_FUSED
+                &&loadval_loadval, &&loadval_load, &&loadval_store,
+                &&loadval_loadprog, &&nand_nand, &&or_idiom, &&constants,
+#endif
+                [STALE_OPCODE] = &&stale
+        };
+
+        uint32_t *registers = data_registers(data);
+        Instruction *program = decoded_segment_zero(data);
+        uint32_t pc = get_program_counter(data);
+        Instruction *ins, fresh;
+        int input;
+#ifdef RUN_FUSED
+        const Fold *fold;
+        uint32_t x, y;
+#endif
+
+        set_fusion(data, FUSION);
+        attach_thread(data);
+        DISPATCH();
+
+conditional_move:
+        if (registers[ins->c] != 0) {
+                registers[ins->a] = registers[ins->b];
+        }
+        DISPATCH();
+segment_load:
+        registers[ins->a] = get_word(data, registers[ins->b],
+                                     registers[ins->c]);
+        DISPATCH();
+segment_store:
+        set_word(data, registers[ins->a], registers[ins->b],
+                 registers[ins->c]);
+        DISPATCH();
+add:
+        registers[ins->a] = registers[ins->b] + registers[ins->c];
+        DISPATCH();
+multiplication:
+        registers[ins->a] = registers[ins->b] * registers[ins->c];
+        DISPATCH();
+division:
+        registers[ins->a] = registers[ins->b] / registers[ins->c];
+        DISPATCH();
+bitwise_nand:
+        registers[ins->a] = ~(registers[ins->b] & registers[ins->c]);
+        DISPATCH();
+map_segment:
+        COUNT_MAP(registers[ins->c]);
+        registers[ins->b] = insert_segment(data, registers[ins->c]);
+        DISPATCH();
+unmap_segment:
+        set_segment_false(data, registers[ins->c]);
+        DISPATCH();
+output:
+        put_output(data, (char) registers[ins->c]);
+        DISPATCH();
+input:
+        set_program_counter(data, pc - 1);
+        input = get_input(data);
+        if (input == EOF) {
+                registers[ins->c] = 0xFFFFFFFF;
+        } else if (input >= 0 && input <= 255) {
+                registers[ins->c] = input;
+        }
+        DISPATCH();
+load_program:
+        /* Read C first, the old program is freed by the replacement */
+        pc = registers[ins->c];
+        PUBLISH_LOAD(registers[ins->b]);
+        replace_segment_0(data, registers[ins->b], pc);
+        program = decoded_segment_zero(data);
+        DISPATCH();
+load_val:
+        registers[ins->a] = ins->value;
+        DISPATCH();
+invalid:
+        DISPATCH();
+stale:
+        /* Its page was stored to since decoding */
+        fresh = refresh_code(data, pc - 1);
+        ins = &fresh;
+        COUNT(ins->opcode);
+        goto *handlers[ins->opcode];
+#ifdef RUN_FUSED
+loadval_loadval:
+        registers[ins->a] = ins->value;
+        ins = &program[pc++];
+        goto load_val;
+loadval_load:
+        registers[ins->a] = ins->value;
+        ins = &program[pc++];
+        goto segment_load;
+loadval_store:
+        registers[ins->a] = ins->value;
+        ins = &program[pc++];
+        goto segment_store;
+loadval_loadprog:
+        registers[ins->a] = ins->value;
+        ins = &program[pc++];
+        goto load_program;
+nand_nand:
+        registers[ins->a] = ~(registers[ins->b] & registers[ins->c]);
+        ins = &program[pc++];
+        goto bitwise_nand;
+or_idiom:
+        x = registers[ins->b];
+        y = registers[program[pc].b];
+        registers[ins->a] = ~x;
+        registers[program[pc].a] = ~y;
+        registers[program[pc + 1].a] = x | y;
+        pc += 2;
+        DISPATCH();
+constants:
+        fold = &folded_constants(data)[ins->b | ins->c << 8];
+        for (x = fold->mask; x != 0; x &= x - 1) {
+                y = __builtin_ctz(x);
+                registers[y] = fold->values[y];
+        }
+        pc += fold->length - 1;
+        DISPATCH();
+#endif
+halt:
+        RUN_HALT();
+}
+
+#pragma GCC diagnostic pop
+
+#undef DISPATCH
+#endif
+
+#undef RUN_UM
+#undef RUN_BUDGET
+#undef RUN_FUSED
+#undef FUSION
+#undef RUN_HEAD
+#undef RUN_HALT
+#undef SPEND
+#undef PUBLISH_PC
+#undef PUBLISH_LOAD
+
+
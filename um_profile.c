@@ -0,0 +1,399 @@
+/* * * * * * * * * * * * * * * * * um_profile.c * * * * * * * * * * * * * * * *
+*
+*     Assignment: CS40 Universal Machine
+*     Authors:  Andrea Cabochan, Chance Rebish
+*     Date:     April 04, 2025
+*
+*     Summary:
+*     A sampling profiler for UM programs. run_um_profiled publishes the pc
+*     of each instruction in profile_pc, and a SIGPROF timer samples it
+*     PROFILE_HZ times a second of CPU time into a table keyed by pc and
+*     program version. A version is the code in segment 0 between two
+*     load_programs from a nonzero segment; its words are kept when it is
+*     replaced, if it was sampled. At exit the hottest regions of each
+*     version are written out as annotated disassembly.
+*
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+#include <signal.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "assert.h"
+#include "um_data.h"
+#include "um_profile.h"
+
+#define PROFILE_HZ 1000
+#define SAMPLE_SLOTS (1 << 18)  /* Distinct (version, pc) pairs kept */
+#define MAX_PROBES 64
+#define MAX_VERSIONS 64         /* Later versions share the last slot */
+#define REGION_GAP 4            /* Sampled words this close share a region */
+#define REGION_CONTEXT 2        /* Words shown around a region */
+#define MAX_REGIONS 10          /* Regions reported per version */
+
+volatile uint32_t profile_pc;
+
+/* One sampled (version, pc) pair; key 0 marks an empty slot */
+struct Sample {
+        uint64_t key;
+        uint64_t count;
+};
+
+/* The code of one version of segment 0 */
+struct Version {
+        uint32_t source;        /* Segment load_program copied it from */
+        uint32_t length;
+        uint32_t *words;        /* Copy of the code, NULL until kept */
+        uint64_t samples;
+};
+
+static struct Sample *samples;
+static struct Version versions[MAX_VERSIONS];
+static volatile uint32_t version;
+static uint64_t total;
+static uint64_t dropped;
+static const char *report_path;
+static struct sigaction previous;
+
+/* * * * * * * * * * * * * * * * * on_sample * * * * * * * * * * * * * * * * *
+*
+* SIGPROF handler: counts one sample for the current version and pc.
+*
+* Parameters:
+*      int signal:      SIGPROF
+*
+* Return: nothing
+*
+* Notes:
+*      Only touches memory allocated before the timer started, so it is
+*      safe to run at any point in the interpreter or the data layer
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static void on_sample(int signal)
+{
+        (void) signal;
+
+        uint32_t v = version;
+        uint64_t key = (uint64_t) (v + 1) << 32 | profile_pc;
+        uint64_t slot = (key * 0x9E3779B97F4A7C15ull) >> 46;
+
+        total++;
+        versions[v].samples++;
+
+        for (int probe = 0; probe < MAX_PROBES; probe++) {
+                struct Sample *s = &samples[(slot + probe) % SAMPLE_SLOTS];
+                if (s->key == key || s->key == 0) {
+                        s->key = key;
+                        s->count++;
+                        return;
+                }
+        }
+        dropped++;
+}
+
+/* * * * * * * * * * * * * * * * * profile_start * * * * * * * * * * * * * * *
+*
+* Starts sampling. The report is written to path by profile_stop.
+*
+* Parameters:
+*      const char *path:        file to write the report to
+*
+* Return: nothing
+*
+* Expects:
+*      run_um_profiled runs the program between profile_start and
+*      profile_stop, so that profile_pc is kept current
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void profile_start(const char *path)
+{
+        samples = calloc(SAMPLE_SLOTS, sizeof(struct Sample));
+        assert(samples != NULL);
+        report_path = path;
+
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = on_sample;
+        action.sa_flags = SA_RESTART;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGPROF, &action, &previous);
+
+        struct itimerval timer = {
+                { 0, 1000000 / PROFILE_HZ }, { 0, 1000000 / PROFILE_HZ }
+        };
+        setitimer(ITIMER_PROF, &timer, NULL);
+}
+
+/* * * * * * * * * * * * * * * * * keep_version * * * * * * * * * * * * * * * *
+*
+* Copies the code of the current version from segment 0, if it was
+* sampled and has not been kept already.
+*
+* Parameters:
+*      Data data:       the machine whose segment 0 holds the version
+*
+* Return: nothing
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static void keep_version(Data data)
+{
+        struct Version *v = &versions[version];
+        if (v->samples == 0 || v->words != NULL) {
+                return;
+        }
+
+        v->length = segment_length(data, 0);
+        v->words = malloc((v->length + 1) * sizeof(uint32_t));
+        assert(v->words != NULL);
+        memcpy(v->words, segment_zero(data), v->length * sizeof(uint32_t));
+}
+
+/* * * * * * * * * * * * * * * * * profile_load * * * * * * * * * * * * * * * *
+*
+* Called by run_um_profiled before load_program: a load from a nonzero
+* segment ends the current version and starts the next.
+*
+* Parameters:
+*      Data data:               the machine, before segment 0 is replaced
+*      uint32_t segment:        the segment being loaded
+*
+* Return: nothing
+*
+* Notes:
+*      Once MAX_VERSIONS versions have been seen, the last slot collects
+*      the samples of every later one and its code is not kept
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void profile_load(Data data, uint32_t segment)
+{
+        if (segment == 0 || version == MAX_VERSIONS - 1) {
+                return;
+        }
+
+        keep_version(data);
+        versions[version + 1].source = segment;
+        version++;
+
+        if (version == MAX_VERSIONS - 1) {
+                versions[version].source = UINT32_MAX;
+        }
+}
+
+/* * * * * * * * * * * * * * * * * disassemble * * * * * * * * * * * * * * * *
+*
+* Writes one UM instruction word as a line of pseudo-C.
+*
+* Parameters:
+*      uint32_t word:   the instruction
+*      FILE *out:       where to write it
+*
+* Return: nothing
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static void disassemble(uint32_t word, FILE *out)
+{
+        unsigned a = (word >> 6) & 7, b = (word >> 3) & 7, c = word & 7;
+
+        switch (word >> 28) {
+        case 0:
+                fprintf(out, "if (r%u) r%u = r%u", c, a, b);
+                break;
+        case 1:
+                fprintf(out, "r%u = m[r%u][r%u]", a, b, c);
+                break;
+        case 2:
+                fprintf(out, "m[r%u][r%u] = r%u", a, b, c);
+                break;
+        case 3:
+                fprintf(out, "r%u = r%u + r%u", a, b, c);
+                break;
+        case 4:
+                fprintf(out, "r%u = r%u * r%u", a, b, c);
+                break;
+        case 5:
+                fprintf(out, "r%u = r%u / r%u", a, b, c);
+                break;
+        case 6:
+                fprintf(out, "r%u = ~(r%u & r%u)", a, b, c);
+                break;
+        case 7:
+                fprintf(out, "halt");
+                break;
+        case 8:
+                fprintf(out, "r%u = map(r%u)", b, c);
+                break;
+        case 9:
+                fprintf(out, "unmap(r%u)", c);
+                break;
+        case 10:
+                fprintf(out, "output(r%u)", c);
+                break;
+        case 11:
+                fprintf(out, "r%u = input()", c);
+                break;
+        case 12:
+                fprintf(out, "load_program(r%u, r%u)", b, c);
+                break;
+        case 13:
+                fprintf(out, "r%u = %u", (word >> 25) & 7, word & 0x1FFFFFF);
+                break;
+        default:
+                fprintf(out, ".word 0x%08x", word);
+                break;
+        }
+}
+
+/* A sampled word of one version */
+struct Hit {
+        uint32_t pc;
+        uint64_t count;
+};
+
+/* A run of nearby sampled words */
+struct Region {
+        uint32_t first, last;   /* Words shown, context included */
+        uint64_t count;
+        size_t hit;             /* Index of its first hit */
+};
+
+static int by_pc(const void *x, const void *y)
+{
+        const struct Hit *a = x, *b = y;
+        return (a->pc > b->pc) - (a->pc < b->pc);
+}
+
+static int by_count(const void *x, const void *y)
+{
+        const struct Region *a = x, *b = y;
+        return (a->count < b->count) - (a->count > b->count);
+}
+
+/* * * * * * * * * * * * * * * * * report_version * * * * * * * * * * * * * * *
+*
+* Writes the hottest regions of one version, each as disassembly with the
+* share of all samples taken at every word.
+*
+* Parameters:
+*      uint32_t v:      index of the version
+*      FILE *out:       the report
+*
+* Return: nothing
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static void report_version(uint32_t v, FILE *out)
+{
+        struct Version *ver = &versions[v];
+
+        fprintf(out, "\nprogram %u: ", v);
+        if (v == 0) {
+                fprintf(out, "initial segment 0");
+        } else if (ver->source == UINT32_MAX) {
+                fprintf(out, "every program loaded after the first %d",
+                        MAX_VERSIONS - 1);
+        } else {
+                fprintf(out, "loaded from segment %u", ver->source);
+        }
+        fprintf(out, ", %llu samples (%.1f%%)\n",
+                (unsigned long long) ver->samples,
+                100.0 * ver->samples / total);
+
+        if (ver->words == NULL) {
+                return;
+        }
+
+        /* Gather this version's samples in pc order */
+        size_t nhits = 0;
+        struct Hit *hits = malloc(SAMPLE_SLOTS * sizeof(struct Hit));
+        assert(hits != NULL);
+        for (size_t i = 0; i < SAMPLE_SLOTS; i++) {
+                if (samples[i].key >> 32 == (uint64_t) v + 1 &&
+                    (uint32_t) samples[i].key < ver->length) {
+                        hits[nhits].pc = (uint32_t) samples[i].key;
+                        hits[nhits].count = samples[i].count;
+                        nhits++;
+                }
+        }
+        qsort(hits, nhits, sizeof(struct Hit), by_pc);
+
+        /* Merge nearby hits into regions */
+        size_t nregions = 0;
+        struct Region *regions = malloc((nhits + 1) * sizeof(struct Region));
+        assert(regions != NULL);
+        for (size_t i = 0; i < nhits; i++) {
+                struct Region *r;
+                if (nregions > 0 &&
+                    hits[i].pc - regions[nregions - 1].last <= REGION_GAP) {
+                        r = &regions[nregions - 1];
+                        r->last = hits[i].pc;
+                        r->count += hits[i].count;
+                } else {
+                        r = &regions[nregions++];
+                        r->first = r->last = hits[i].pc;
+                        r->count = hits[i].count;
+                        r->hit = i;
+                }
+        }
+        qsort(regions, nregions, sizeof(struct Region), by_count);
+
+        for (size_t i = 0; i < nregions && i < MAX_REGIONS; i++) {
+                struct Region *r = &regions[i];
+                uint32_t first = r->first < REGION_CONTEXT ?
+                                 0 : r->first - REGION_CONTEXT;
+                uint32_t last = r->last + REGION_CONTEXT >= ver->length ?
+                                ver->length - 1 : r->last + REGION_CONTEXT;
+                size_t h = r->hit;
+
+                fprintf(out, "\n  words %u-%u: %.1f%%\n", r->first, r->last,
+                        100.0 * r->count / total);
+                for (uint32_t pc = first; pc <= last; pc++) {
+                        if (h < nhits && hits[h].pc == pc) {
+                                fprintf(out, "  %6.2f%%", 100.0 *
+                                        hits[h].count / total);
+                                h++;
+                        } else {
+                                fprintf(out, "         ");
+                        }
+                        fprintf(out, " %10u  ", pc);
+                        disassemble(ver->words[pc], out);
+                        fputc('\n', out);
+                }
+        }
+
+        free(regions);
+        free(hits);
+}
+
+/* * * * * * * * * * * * * * * * * profile_stop * * * * * * * * * * * * * * * *
+*
+* Stops sampling and writes the report to the file given to profile_start.
+*
+* Parameters:
+*      Data data:       the machine, after the program halted
+*
+* Return: nothing
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void profile_stop(Data data)
+{
+        struct itimerval off = { { 0, 0 }, { 0, 0 } };
+        setitimer(ITIMER_PROF, &off, NULL);
+        sigaction(SIGPROF, &previous, NULL);
+
+        if (version != MAX_VERSIONS - 1) {
+                keep_version(data);
+        }
+
+        FILE *out = fopen(report_path, "w");
+        assert(out != NULL);
+
+        fprintf(out, "UM profile: %llu samples, timer at %d Hz of CPU time, "
+                     "%llu not attributed to a word\n",
+                (unsigned long long) total, PROFILE_HZ,
+                (unsigned long long) dropped);
+
+        for (uint32_t v = 0; v <= version && total > 0; v++) {
+                if (versions[v].samples > 0) {
+                        report_version(v, out);
+                }
+        }
+
+        fclose(out);
+        for (uint32_t v = 0; v <= version; v++) {
+                free(versions[v].words);
+        }
+        free(samples);
+}
@@ -0,0 +1,25 @@
+/* * * * * * * * * * * * * * * * * um_profile.h * * * * * * * * * * * * * * * *
+*
+*     Assignment: CS40 Universal Machine
+*     Authors:  Andrea Cabochan, Chance Rebish
+*     Date:     April 04, 2025
+*
+*     Summary:
+*     Declares the sampling profiler defined in um_profile.c, used by
+*     um --profile FILE together with run_um_profiled
+*
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef UM_PROFILE_INCLUDED
+#define UM_PROFILE_INCLUDED
+
+#include <stdint.h>
+#include "um_data.h"
+
+extern volatile uint32_t profile_pc;
+
+extern void profile_start(const char *path);
+extern void profile_load(Data data, uint32_t segment);
+extern void profile_stop(Data data);
+
+#endif
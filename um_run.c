@@ -0,0 +1,156 @@
+/* * * * * * * * * * * * * * * * * um_run.c * * * * * * * * * * * * * * * * * *
+*
+*     Assignment: CS40 Universal Machine
+*     Authors:  Andrea Cabochan, Chance Rebish
+*     Date:     April 04, 2025
+*
+*     Summary:
+*     The Universal Machine interpreter: run_um, which executes segment 0
+*     with either the switch loop or the direct-threaded dispatcher (make
+*     DISPATCH=threaded), plus run_um_profiled for --profile, run_um_safe
+*     for --safe and run_um_budget for libum. All are built from
+*     um_loop.h. Kept apart from main so that translated programs can link
+*     it as their fallback.
+*
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "assert.h"
+#include "um_data.h"
+#include "um_run.h"
+#include "um_profile.h"
+#include "um_safe.h"
+
+/*
+ * The counting build (make um-count) tallies every instruction fetched by
+ * opcode, and the size of every segment mapped in power-of-two buckets:
+ * bucket 0 holds size 0 and bucket k sizes 2^(k-1) up to 2^k - 1. Fetches
+ * of stale entries (STALE_OPCODE) are tallied apart and not reported.
+ */
+#ifdef UM_COUNT
+static uint64_t opcode_counts[STALE_OPCODE + 1];
+static uint64_t map_sizes[33];
+#define COUNT(op) (opcode_counts[(op)]++)
+#define COUNT_MAP(size) \
+        (map_sizes[(size) == 0 ? 0 : 32 - __builtin_clz(size)]++)
+#else
+#define COUNT(op) ((void) 0)
+#define COUNT_MAP(size) ((void) 0)
+#endif
+
+/*
+ * The plain interpreter, which runs common pairs of instructions as one
+ * (see set_fusion). The counting build leaves them apart so that it counts
+ * every instruction.
+ */
+#define RUN_UM run_um
+#ifndef UM_COUNT
+#define RUN_FUSED
+#endif
+#define PUBLISH_PC(pc) ((void) 0)
+#define PUBLISH_LOAD(segment) ((void) 0)
+#include "um_loop.h"
+
+/* The interpreter for --profile, which shows the sampler where it is */
+#define RUN_UM run_um_profiled
+#define PUBLISH_PC(pc) (profile_pc = (pc))
+#define PUBLISH_LOAD(segment) profile_load(data, (segment))
+#include "um_loop.h"
+
+/* The interpreter for --safe, which leaves the pc for the fault handler */
+#define RUN_UM run_um_safe
+#define PUBLISH_PC(pc) (safe_pc = (pc))
+#define PUBLISH_LOAD(segment) ((void) 0)
+#include "um_loop.h"
+
+/* The interpreter for libum, which runs for a budget of instructions */
+#define RUN_UM run_um_budget
+#define RUN_BUDGET
+#define PUBLISH_PC(pc) ((void) 0)
+#define PUBLISH_LOAD(segment) ((void) 0)
+#include "um_loop.h"
+
+#ifdef UM_COUNT
+/* * * * * * * * * * * * * * * * run_stats * * * * * * * * * * * * * * *
+ *
+ * Prints the counting build's report: instructions executed, a histogram
+ * of the instruction mix by opcode, the calls made to insert_segment and
+ * set_segment_false, and a histogram of the sizes passed to map.
+ *
+ * Parameters:
+ *      FILE *out: where to print the report
+ *
+ * Return:
+ *      void
+ *
+ * Notes:
+ *      Only instructions run by run_um are counted, not those the JIT or
+ *      translated code execute. Bars are scaled to the largest count.
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void run_stats(FILE *out)
+{
+        static const char *const names[16] = {
+                "cmov", "load", "store", "add", "mul", "div", "nand",
+                "halt", "map", "unmap", "output", "input", "loadprog",
+                "loadval", "invalid", "invalid"
+        };
+        uint64_t total = 0, most = 1;
+
+        for (int op = 0; op < 16; op++) {
+                total += opcode_counts[op];
+                if (opcode_counts[op] > most) {
+                        most = opcode_counts[op];
+                }
+        }
+
+        fprintf(out, "instructions executed: %llu\n",
+                (unsigned long long) total);
+        fprintf(out, "insert_segment calls: %llu\n",
+                (unsigned long long) opcode_counts[8]);
+        fprintf(out, "set_segment_false calls: %llu\n",
+                (unsigned long long) opcode_counts[9]);
+
+        fprintf(out, "\n%-12s %14s %7s\n", "opcode", "count", "share");
+        for (int op = 0; op < 16; op++) {
+                if (op >= 14 && opcode_counts[op] == 0) {
+                        continue;
+                }
+                fprintf(out, "%2d %-9s %14llu %6.2f%% ", op, names[op],
+                        (unsigned long long) opcode_counts[op],
+                        total == 0 ? 0.0 : 100.0 * opcode_counts[op] / total);
+                for (uint64_t i = 0; i < 40 * opcode_counts[op] / most; i++) {
+                        fputc('#', out);
+                }
+                fputc('\n', out);
+        }
+
+        most = 1;
+        for (int k = 0; k < 33; k++) {
+                if (map_sizes[k] > most) {
+                        most = map_sizes[k];
+                }
+        }
+
+        fprintf(out, "\n%-23s %14s\n", "map size (words)", "count");
+        for (int k = 0; k < 33; k++) {
+                if (map_sizes[k] == 0) {
+                        continue;
+                }
+                uint64_t low = k == 0 ? 0 : (uint64_t) 1 << (k - 1);
+                uint64_t high = k == 0 ? 0 : ((uint64_t) 1 << k) - 1;
+                fprintf(out, "%10llu - %-10llu %14llu ",
+                        (unsigned long long) low, (unsigned long long) high,
+                        (unsigned long long) map_sizes[k]);
+                for (uint64_t i = 0; i < 40 * map_sizes[k] / most; i++) {
+                        fputc('#', out);
+                }
+                fputc('\n', out);
+        }
+}
+#endif
+
+#undef COUNT
+#undef COUNT_MAP
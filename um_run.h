@@ -0,0 +1,29 @@
+/* * * * * * * * * * * * * * * * * um_run.h * * * * * * * * * * * * * * * * * *
+*
+*     Assignment: CS40 Universal Machine
+*     Authors:  Andrea Cabochan, Chance Rebish
+*     Date:     April 04, 2025
+*
+*     Summary:
+*     Declares the Universal Machine interpreter defined in um_run.c
+*
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef UM_RUN_INCLUDED
+#define UM_RUN_INCLUDED
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "um_data.h"
+
+extern void run_um(Data data);
+extern void run_um_profiled(Data data);
+extern void run_um_safe(Data data);
+extern bool run_um_budget(Data data, uint64_t budget);
+
+#ifdef UM_COUNT
+extern void run_stats(FILE *out);
+#endif
+
+#endif
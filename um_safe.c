@@ -0,0 +1,173 @@
+/* * * * * * * * * * * * * * * * * um_safe.c * * * * * * * * * * * * * * * * *
+*
+*     Assignment: CS40 Universal Machine
+*     Authors:  Andrea Cabochan, Chance Rebish
+*     Date:     April 04, 2025
+*
+*     Summary:
+*     Safe mode for UM programs. get_word and set_word do no bounds checks,
+*     so instead guard_segments puts large segments in front of guard
+*     pages, and a SIGSEGV handler turns an access past the end of one into
+*     a report of the segment, the word index and the pc, which
+*     run_um_safe publishes in safe_pc. The load and store paths are the
+*     same as without safe mode.
+*
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "assert.h"
+#include "um_data.h"
+#include "um_safe.h"
+
+volatile uint32_t safe_pc;
+
+static Data machine;
+static struct sigaction previous;
+
+/* * * * * * * * * * * * * * * * * append_text * * * * * * * * * * * * * * *
+*
+* Appends a string to a message. This and append_number avoid stdio, which
+* a signal handler may not use.
+*
+* Parameters:
+*      char *end:          where to append
+*      const char *text:   string to append
+*
+* Return: the new end of the message
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static char *append_text(char *end, const char *text)
+{
+        size_t length = strlen(text);
+        memcpy(end, text, length);
+        return end + length;
+}
+
+/* * * * * * * * * * * * * * * * * append_number * * * * * * * * * * * * * * *
+*
+* Appends a number in decimal to a message.
+*
+* Parameters:
+*      char *end:          where to append
+*      int64_t number:     number to append
+*
+* Return: the new end of the message
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static char *append_number(char *end, int64_t number)
+{
+        char digits[20];
+        int n = 0;
+        uint64_t value = number < 0 ? -(uint64_t) number : (uint64_t) number;
+
+        if (number < 0) {
+                *end++ = '-';
+        }
+        do {
+                digits[n++] = '0' + value % 10;
+                value /= 10;
+        } while (value != 0);
+        while (n > 0) {
+                *end++ = digits[--n];
+        }
+        return end;
+}
+
+/* * * * * * * * * * * * * * * * * on_fault * * * * * * * * * * * * * * * * *
+*
+* SIGSEGV handler: reports the faulting access and exits.
+*
+* Parameters:
+*      int signal:          SIGSEGV
+*      siginfo_t *info:     holds the faulting address
+*      void *context:       unused
+*
+* Return: does not return, unless the fault was a store into segment 0
+*
+* Notes:
+*      Output the program produced before the fault is flushed first. A
+*      fault that is not in a guard page (an unmapped identifier or a wild
+*      index) is reported with the pc alone.
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static void on_fault(int signal, siginfo_t *info, void *context)
+{
+        (void) signal;
+        (void) context;
+
+        char message[160];
+        char *end = message;
+        uint32_t segment;
+        int64_t word;
+
+        /* Stores into segment 0 fault by design and carry on */
+        if (code_write_fault(info->si_addr)) {
+                return;
+        }
+
+        flush_output(machine);
+
+        if (segment_at_address(machine, info->si_addr, &segment, &word)) {
+                end = append_text(end, "um: access to word ");
+                end = append_number(end, word);
+                end = append_text(end, " of segment ");
+                end = append_number(end, segment);
+                end = append_text(end, " of length ");
+                end = append_number(end, segment_length(machine, segment));
+        } else {
+                end = append_text(end, "um: access outside any segment");
+        }
+        end = append_text(end, " at pc ");
+        end = append_number(end, safe_pc);
+        end = append_text(end, "\n");
+
+        ssize_t written = write(STDERR_FILENO, message, end - message);
+        (void) written;
+        _exit(EXIT_FAILURE);
+}
+
+/* * * * * * * * * * * * * * * * * safe_start * * * * * * * * * * * * * * * *
+*
+* Turns on safe mode for a machine: guards its large segments and installs
+* the fault handler.
+*
+* Parameters:
+*      Data data:       the machine about to run
+*
+* Return: nothing
+*
+* Expects:
+*      run_um_safe runs the program between safe_start and safe_stop, so
+*      that safe_pc is kept current. Only one machine is in safe mode at a
+*      time.
+*
+* Notes:
+*      Segments shorter than a page are not guarded, and accesses far past
+*      the end of a segment may land in other memory without faulting
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void safe_start(Data data)
+{
+        machine = data;
+        guard_segments(data);
+
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_sigaction = on_fault;
+        action.sa_flags = SA_SIGINFO;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGSEGV, &action, &previous);
+}
+
+/* * * * * * * * * * * * * * * * * safe_stop * * * * * * * * * * * * * * * * *
+*
+* Restores the SIGSEGV handler that was in place before safe_start.
+*
+* Parameters: none
+*
+* Return: nothing
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void safe_stop(void)
+{
+        sigaction(SIGSEGV, &previous, NULL);
+        machine = NULL;
+}
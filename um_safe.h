@@ -0,0 +1,24 @@
+/* * * * * * * * * * * * * * * * * um_safe.h * * * * * * * * * * * * * * * * *
+*
+*     Assignment: CS40 Universal Machine
+*     Authors:  Andrea Cabochan, Chance Rebish
+*     Date:     April 04, 2025
+*
+*     Summary:
+*     Declares the fault reporting of safe mode defined in um_safe.c, used
+*     by um --safe together with run_um_safe
+*
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef UM_SAFE_INCLUDED
+#define UM_SAFE_INCLUDED
+
+#include <stdint.h>
+#include "um_data.h"
+
+extern volatile uint32_t safe_pc;
+
+extern void safe_start(Data data);
+extern void safe_stop(void);
+
+#endif
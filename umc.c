@@ -0,0 +1,636 @@
+/* * * * * * * * * * * * * * * * * * umc.c * * * * * * * * * * * * * * * * * *
+*
+*     Assignment: CS40 Universal Machine
+*     Authors:  Andrea Cabochan, Chance Rebish
+*     Date:     April 04, 2025
+*
+*     Summary:
+*     Ahead-of-time translator from a UM binary to C. Segment 0 is translated
+*     into one C function per entry point with the UM registers in locals,
+*     which gcc compiles into a standalone executable linked against
+*     um_data.o (segments and I/O) and um_run.o (the interpreter).
+*
+*     Only code the translator can find is translated: straight-line runs
+*     from pc 0 and from every constant that code puts in a register with
+*     load_val, which covers direct jumps and return addresses. At run time
+*     the translated code hands the machine to run_um when
+*       - a jump goes to a word that was not translated,
+*       - load_program loads a segment other than 0, or
+*       - a store changes translated code that can still execute (the rest
+*         of the running function, or any function entered later).
+*
+*     Usage: umc program.um > program.c
+*
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "assert.h"
+#include "um_data.h"
+
+/* struct Program
+*
+* Segment 0 of the program being translated and what is known about it
+*/
+struct Program {
+        uint32_t *words;        /* Raw words of segment 0 */
+        Instruction *code;      /* The same words decoded */
+        uint32_t length;        /* Words in segment 0 */
+        uint32_t *run_end;      /* Last word of each word's run */
+        bool *translated;       /* Word is emitted as code */
+        bool *walked;           /* Word was used as an entry point */
+        uint32_t *owner;        /* Entry of the function holding each word */
+};
+
+/* * * * * * * * * * * * * * * * * find_runs * * * * * * * * * * * * * * * * *
+*
+* Splits segment 0 into runs, each ending at a halt or load_program (or the
+* end of the segment), and records the last word of each word's run.
+*
+* Parameters:
+*      struct Program *p:       program with words, code and length set
+*
+* Return: nothing
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static void find_runs(struct Program *p)
+{
+        uint32_t start = 0;
+
+        for (uint32_t i = 0; i < p->length; i++) {
+                uint8_t op = p->code[i].opcode;
+                if (op == 7 || op == 12 || i + 1 == p->length) {
+                        for (uint32_t j = start; j <= i; j++) {
+                                p->run_end[j] = i;
+                        }
+                        start = i + 1;
+                }
+        }
+}
+
+/* * * * * * * * * * * * * * * * * walk_code * * * * * * * * * * * * * * * * *
+*
+* Marks the runs reached from the pending entry points as code, pushing any
+* new entry points found along the way, until none are pending.
+*
+* Parameters:
+*      struct Program *p:       program whose runs have been found
+*      uint32_t *work:          stack of entry points still to walk
+*      uint32_t *pending:       number of entries on the stack
+*
+* Return: nothing
+*
+* Notes:
+*      Register constants are tracked through load_val, add, multiply,
+*      division and NAND within a run, so a jump through a register built
+*      from several instructions is still resolved
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static void walk_code(struct Program *p, uint32_t *work, uint32_t *pending)
+{
+        while (*pending > 0) {
+                uint32_t pc = work[--*pending];
+                bool known[8] = { false };
+                uint32_t value[8] = { 0 };
+                uint32_t found[2];
+                int nfound;
+
+                for (; pc < p->length; pc++) {
+                        Instruction *ins = &p->code[pc];
+                        int a = ins->a, b = ins->b, c = ins->c;
+
+                        p->translated[pc] = true;
+                        nfound = 0;
+
+                        switch (ins->opcode) {
+                        case 0:
+                                if (known[c] && value[c] != 0) {
+                                        known[a] = known[b];
+                                        value[a] = value[b];
+                                } else if (!known[c]) {
+                                        known[a] = false;
+                                }
+                                break;
+                        case 3:
+                        case 4:
+                        case 5:
+                        case 6:
+                                if (known[b] && known[c] &&
+                                    !(ins->opcode == 5 && value[c] == 0)) {
+                                        uint32_t x = value[b], y = value[c];
+                                        value[a] = ins->opcode == 3 ? x + y :
+                                                   ins->opcode == 4 ? x * y :
+                                                   ins->opcode == 5 ? x / y :
+                                                   ~(x & y);
+                                        known[a] = true;
+                                        found[nfound++] = value[a];
+                                } else {
+                                        known[a] = false;
+                                }
+                                break;
+                        case 1:
+                                known[a] = false;
+                                break;
+                        case 8:
+                                known[b] = false;
+                                break;
+                        case 11:
+                                known[c] = false;
+                                break;
+                        case 12:
+                                if (known[c]) {
+                                        found[nfound++] = value[c];
+                                }
+                                break;
+                        case 13:
+                                known[a] = true;
+                                value[a] = ins->value;
+                                found[nfound++] = ins->value;
+                                break;
+                        default:
+                                break;
+                        }
+
+                        for (int i = 0; i < nfound; i++) {
+                                if (found[i] < p->length &&
+                                    !p->walked[found[i]]) {
+                                        p->walked[found[i]] = true;
+                                        work[(*pending)++] = found[i];
+                                }
+                        }
+
+                        if (ins->opcode == 7 || ins->opcode == 12) {
+                                break;
+                        }
+                }
+        }
+
+}
+
+/* * * * * * * * * * * * * * * * * find_code * * * * * * * * * * * * * * * * *
+*
+* Marks the words to translate: the runs reached from pc 0, from every
+* load_val constant or constant jump target found along the way, and from
+* every word whose value is an index into segment 0.
+*
+* Parameters:
+*      struct Program *p:       program whose runs have been found
+*
+* Return: nothing
+*
+* Notes:
+*      Only conditional moves among the instructions encode as words this
+*      small, so code is rarely mistaken for a table entry
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static void find_code(struct Program *p)
+{
+        uint32_t *work = malloc((p->length + 1) * sizeof(uint32_t));
+        assert(work != NULL);
+        uint32_t pending = 0;
+
+        if (p->length > 0) {
+                work[pending++] = 0;
+                p->walked[0] = true;
+        }
+
+        /* Jump tables: words that hold an index into segment 0 */
+        for (uint32_t i = 0; i < p->length; i++) {
+                uint32_t v = p->words[i];
+                if (v < p->length && !p->walked[v]) {
+                        p->walked[v] = true;
+                        work[pending++] = v;
+                }
+        }
+
+        walk_code(p, work, &pending);
+
+        free(work);
+}
+
+/* * * * * * * * * * * * * * * * * find_owners * * * * * * * * * * * * * * * *
+*
+* Records the entry point of the function that holds each translated word,
+* and the length of segment 0 for words that are not code.
+*
+* Parameters:
+*      struct Program *p:       program whose code has been found
+*
+* Return: nothing
+*
+* Notes:
+*      Each function runs from its entry to the next entry or the end of
+*      its run, so the functions split the translated words between them
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static void find_owners(struct Program *p)
+{
+        uint32_t entry = p->length;
+
+        for (uint32_t i = 0; i < p->length; i++) {
+                if (p->walked[i]) {
+                        entry = i;
+                }
+                p->owner[i] = p->translated[i] ? entry : p->length;
+        }
+}
+
+/* * * * * * * * * * * * * * * * * emit_prologue * * * * * * * * * * * * * * *
+*
+* Writes the part of the C file before the translated code: the machine
+* state, the program image, the function tables and the store helper.
+*
+* Parameters:
+*      struct Program *p:       program being translated
+*      uint32_t limit:          one past the last translated word
+*      const char *name:        file the program came from
+*      FILE *out:               C file being written
+*
+* Return: nothing
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static void emit_prologue(struct Program *p, uint32_t limit, const char *name,
+                          FILE *out)
+{
+        fprintf(out, "/* Translated from %s by umc. Do not edit. */\n\n", name);
+        fprintf(out, "#include <stdio.h>\n#include <stdint.h>\n"
+                     "#include <stdlib.h>\n#include \"um_data.h\"\n"
+                     "#include \"um_run.h\"\n\n");
+        fprintf(out, "#define LIMIT %uu\n\n", limit);
+        fprintf(out, "enum { RUNNING, HALTED, INTERPRET };\n\n"
+                     "struct State {\n"
+                     "        uint32_t r[8];\n"
+                     "        int stop;\n"
+                     "};\n\n"
+                     "typedef uint32_t (*Entry)(Data data, struct State *s);\n"
+                     "\n");
+
+        /* The image, in .um byte order, is loaded through the data layer */
+        fprintf(out, "static const uint8_t program[] = {");
+        for (uint32_t i = 0; i < p->length; i++) {
+                uint32_t w = p->words[i];
+                fprintf(out, "%s0x%02x,0x%02x,0x%02x,0x%02x,",
+                        i % 4 == 0 ? "\n" : "", w >> 24, (w >> 16) & 0xFF,
+                        (w >> 8) & 0xFF, w & 0xFF);
+        }
+        fprintf(out, "\n};\n\n");
+
+        /* Words that are not code point at LIMIT, which is never entered */
+        fprintf(out, "static const uint32_t owner[LIMIT + 1] = {");
+        for (uint32_t i = 0; i < limit; i++) {
+                fprintf(out, "%s%u,", i % 12 == 0 ? "\n" : "",
+                        p->owner[i] < limit ? p->owner[i] : limit);
+        }
+        fprintf(out, "\n0 };\n\nstatic uint8_t dirty[LIMIT + 1];\n\n");
+
+        fprintf(out,
+"/* Stores through the data layer; returns 1 if translated code changed */\n"
+"static inline int store(Data data, uint32_t a, uint32_t b, uint32_t c)\n"
+"{\n"
+"        set_word(data, a, b, c);\n"
+"        if (a != 0 || b >= LIMIT) {\n"
+"                return 0;\n"
+"        }\n"
+"        const uint8_t *w = program + 4 * (size_t) b;\n"
+"        if (c == ((uint32_t) w[0] << 24 | (uint32_t) w[1] << 16 |\n"
+"                  (uint32_t) w[2] << 8 | w[3])) {\n"
+"                return 0;\n"
+"        }\n"
+"        dirty[owner[b]] = 1;\n"
+"        return 1;\n"
+"}\n\n");
+}
+
+/* * * * * * * * * * * * * * * * * registers_used * * * * * * * * * * * * * *
+*
+* Finds which registers the words first..last read or write.
+*
+* Parameters:
+*      struct Program *p:       program being translated
+*      uint32_t first, last:    words of one entry function
+*      unsigned *written:       set to the mask of registers written
+*
+* Return: mask of registers read or written
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static unsigned registers_used(struct Program *p, uint32_t first,
+                               uint32_t last, unsigned *written)
+{
+        unsigned used = 0;
+        *written = 0;
+
+        for (uint32_t pc = first; pc <= last; pc++) {
+                Instruction *ins = &p->code[pc];
+                unsigned a = 1u << ins->a, b = 1u << ins->b, c = 1u << ins->c;
+
+                switch (ins->opcode) {
+                case 0: case 1: case 3: case 4: case 5: case 6:
+                        used |= a | b | c;
+                        *written |= a;
+                        break;
+                case 2: case 12:
+                        used |= a | b | c;
+                        break;
+                case 8:
+                        used |= b | c;
+                        *written |= b;
+                        break;
+                case 9: case 10:
+                        used |= c;
+                        break;
+                case 11:
+                        used |= c;
+                        *written |= c;
+                        break;
+                case 13:
+                        used |= a;
+                        *written |= a;
+                        break;
+                default:
+                        break;
+                }
+        }
+        return used;
+}
+
+/* * * * * * * * * * * * * * * * * emit_save * * * * * * * * * * * * * * * * *
+*
+* Writes the statements that copy the written registers back to the state.
+*
+* Parameters:
+*      unsigned written:        mask of registers the function writes
+*      FILE *out:               C file being written
+*
+* Return: nothing
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static void emit_save(unsigned written, FILE *out)
+{
+        for (int r = 0; r < 8; r++) {
+                if (written & (1u << r)) {
+                        fprintf(out, "s->r[%d] = r%d; ", r, r);
+                }
+        }
+}
+
+/* * * * * * * * * * * * * * * * * emit_instruction * * * * * * * * * * * * *
+*
+* Writes the C statement for the instruction at pc.
+*
+* Parameters:
+*      struct Program *p:       program being translated
+*      uint32_t pc:             translated word to emit
+*      uint32_t entry:          first word of the function being written
+*      uint32_t last:           last word of the function being written
+*      unsigned written:        registers the function writes
+*      FILE *out:               C file being written
+*
+* Return: nothing
+*
+* Notes:
+*      A store that changes a later word of its own function returns
+*      pc + 1, which is not an entry point, so the dispatcher hands it to
+*      run_um
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static void emit_instruction(struct Program *p, uint32_t pc, uint32_t entry,
+                             uint32_t last, unsigned written, FILE *out)
+{
+        Instruction *ins = &p->code[pc];
+        int a = ins->a, b = ins->b, c = ins->c;
+
+        fprintf(out, "        ");
+
+        switch (ins->opcode) {
+        case 0:
+                fprintf(out, "if (r%d != 0) r%d = r%d;\n", c, a, b);
+                break;
+        case 1:
+                fprintf(out, "r%d = get_word(data, r%d, r%d);\n", a, b, c);
+                break;
+        case 2:
+                fprintf(out, "if (store(data, r%d, r%d, r%d) && r%d > %uu && "
+                             "r%d <= %uu) { ",
+                        a, b, c, b, pc, b, last);
+                emit_save(written, out);
+                fprintf(out, "return %uu; }\n", pc + 1);
+                break;
+        case 3:
+                fprintf(out, "r%d = r%d + r%d;\n", a, b, c);
+                break;
+        case 4:
+                fprintf(out, "r%d = r%d * r%d;\n", a, b, c);
+                break;
+        case 5:
+                fprintf(out, "r%d = r%d / r%d;\n", a, b, c);
+                break;
+        case 6:
+                fprintf(out, "r%d = ~(r%d & r%d);\n", a, b, c);
+                break;
+        case 7:
+                fprintf(out, "s->stop = HALTED; return %uu;\n", pc);
+                break;
+        case 8:
+                fprintf(out, "r%d = insert_segment(data, r%d);\n", b, c);
+                break;
+        case 9:
+                fprintf(out, "set_segment_false(data, r%d);\n", c);
+                break;
+        case 10:
+                fprintf(out, "put_output(data, (char) r%d);\n", c);
+                break;
+        case 11:
+                fprintf(out, "set_program_counter(data, %uu); "
+                             "input = get_input(data); "
+                             "r%d = input == EOF ? 0xFFFFFFFFu : "
+                             "(uint32_t) input;\n", pc, c);
+                break;
+        case 12:
+                /* Loops back to the function's own entry stay in C */
+                fprintf(out, "if (r%d == 0 && r%d == %uu && !dirty[%u]) "
+                             "goto top;\n        ", b, c, entry, entry);
+                emit_save(written, out);
+                fprintf(out, "if (r%d != 0) { replace_segment_0(data, r%d, "
+                             "r%d); s->stop = INTERPRET; } return r%d;\n",
+                        b, b, c, c);
+                break;
+        case 13:
+                fprintf(out, "r%d = %uu;\n", a, ins->value);
+                break;
+        default:
+                fprintf(out, ";\n");
+                break;
+        }
+}
+
+/* * * * * * * * * * * * * * * * * emit_entry * * * * * * * * * * * * * * * *
+*
+* Writes the function for one entry point, covering the words from the
+* entry to the end of its run or the next entry point, whichever is first.
+*
+* Parameters:
+*      struct Program *p:       program being translated
+*      uint32_t entry:          first word of the function
+*      FILE *out:               C file being written
+*
+* Return: nothing
+*
+* Notes:
+*      Each function takes the registers it uses into locals and returns
+*      the next pc; the dispatcher in main calls the function for it
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static void emit_entry(struct Program *p, uint32_t entry, FILE *out)
+{
+        uint32_t last = entry;
+        while (last < p->run_end[entry] && !p->walked[last + 1]) {
+                last++;
+        }
+
+        unsigned written;
+        unsigned used = registers_used(p, entry, last, &written);
+        uint8_t op = p->code[last].opcode;
+
+        fprintf(out, "static uint32_t E%u(Data data, struct State *s)\n{\n",
+                entry);
+        for (int r = 0; r < 8; r++) {
+                if (used & (1u << r)) {
+                        fprintf(out, "        uint32_t r%d = s->r[%d];\n",
+                                r, r);
+                }
+        }
+        for (uint32_t pc = entry; pc <= last; pc++) {
+                if (p->code[pc].opcode == 11) {
+                        fprintf(out, "        int input;\n");
+                        break;
+                }
+        }
+        fprintf(out, "        (void) data; (void) s;\n");
+        if (op == 12) {
+                fprintf(out, "top:\n");
+        }
+
+        for (uint32_t pc = entry; pc <= last; pc++) {
+                emit_instruction(p, pc, entry, last, written, out);
+        }
+
+        /* Runs that end without a halt or jump go on to the next word */
+        if (op != 7 && op != 12) {
+                if (last + 1 == p->length) {
+                        fprintf(out, "        s->stop = HALTED;\n");
+                }
+                fprintf(out, "        ");
+                emit_save(written, out);
+                fprintf(out, "return %uu;\n", last + 1);
+        }
+        fprintf(out, "}\n\n");
+}
+
+/* * * * * * * * * * * * * * * * * emit_epilogue * * * * * * * * * * * * * * *
+*
+* Writes the table of entry functions and main, which dispatches between
+* them and hands the machine to run_um when it leaves translated code.
+*
+* Parameters:
+*      struct Program *p:       program being translated
+*      uint32_t limit:          one past the last translated word
+*      FILE *out:               C file being written
+*
+* Return: nothing
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static void emit_epilogue(struct Program *p, uint32_t limit, FILE *out)
+{
+        fprintf(out, "static const Entry entries[LIMIT + 1] = {");
+        for (uint32_t i = 0; i < limit; i++) {
+                if (p->walked[i]) {
+                        fprintf(out, "\n        [%u] = E%u,", i, i);
+                }
+        }
+        fprintf(out, "\n};\n\n");
+
+        fprintf(out,
+"int main(void)\n"
+"{\n"
+"        FILE *fp = fmemopen((void *) program, sizeof(program), \"rb\");\n"
+"        Data data = initialize_data(fp);\n"
+"        fclose(fp);\n"
+"\n"
+"        struct State s = { { 0 }, RUNNING };\n"
+"        uint32_t pc = 0;\n"
+"\n"
+"        while (s.stop == RUNNING) {\n"
+"                if (pc >= LIMIT || entries[pc] == NULL || dirty[pc]) {\n"
+"                        s.stop = INTERPRET;\n"
+"                        break;\n"
+"                }\n"
+"                pc = entries[pc](data, &s);\n"
+"        }\n"
+"\n"
+"        if (s.stop == INTERPRET) {\n"
+"                for (int i = 0; i < 8; i++) {\n"
+"                        set_register(data, i, s.r[i]);\n"
+"                }\n"
+"                set_program_counter(data, pc);\n"
+"                run_um(data);\n"
+"        }\n"
+"\n"
+"        data_free(&data);\n"
+"        return EXIT_SUCCESS;\n"
+"}\n");
+}
+
+/* * * * * * * * * * * * * * * * * * * main * * * * * * * * * * * * * * * * *
+*
+* Translates the UM binary named on the command line and writes the C
+* program to standard output.
+*
+* Parameters:
+*      int argc: number of command-line arguments (must be 2)
+*      char *argv[]: argv[1] is the path to the UM binary
+*
+* Return:
+*      EXIT_SUCCESS upon success, EXIT_FAILURE on bad usage
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+int main(int argc, char *argv[])
+{
+        if (argc != 2) {
+                fprintf(stderr, "Usage: umc program.um > program.c\n");
+                return EXIT_FAILURE;
+        }
+
+        FILE *fp = fopen(argv[1], "rb");
+        assert(fp != NULL);
+        Data data = initialize_data(fp);
+        fclose(fp);
+        if (data == NULL) {
+                fprintf(stderr, "Invalid .um file");
+                return EXIT_FAILURE;
+        }
+
+        struct Program p;
+        p.words = segment_zero(data);
+        p.code = decoded_segment_zero(data);
+        p.length = segment_length(data, 0);
+        p.run_end = calloc(p.length + 1, sizeof(uint32_t));
+        p.translated = calloc(p.length + 1, sizeof(bool));
+        p.walked = calloc(p.length + 1, sizeof(bool));
+        p.owner = calloc(p.length + 1, sizeof(uint32_t));
+        assert(p.run_end && p.translated && p.walked && p.owner);
+
+        find_runs(&p);
+        find_code(&p);
+        find_owners(&p);
+
+        uint32_t limit = p.length;
+        while (limit > 0 && !p.translated[limit - 1]) {
+                limit--;
+        }
+
+        emit_prologue(&p, limit, argv[1], stdout);
+        for (uint32_t pc = 0; pc < limit; pc++) {
+                if (p.walked[pc]) {
+                        emit_entry(&p, pc, stdout);
+                }
+        }
+        emit_epilogue(&p, limit, stdout);
+
+        free(p.owner);
+        free(p.run_end);
+        free(p.translated);
+        free(p.walked);
+        data_free(&data);
+        return EXIT_SUCCESS;
+}